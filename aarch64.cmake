@@ -11,10 +11,20 @@ set(CMAKE_C_COMPILER_TARGET aarch64-none-elf)
 set(CMAKE_CXX_COMPILER_TARGET aarch64-none-elf)
 add_compile_options(-target ${CMAKE_C_COMPILER_TARGET})
 add_link_options(-target ${CMAKE_C_COMPILER_TARGET})
+# The vector stubs only save the general purpose registers.
+add_compile_options(-mgeneral-regs-only)
 
 set(ARCH_SOURCES
     src/arch/aarch64/arch.c
     src/arch/aarch64/evt.S
-    src/arch/aarch64/paging.c)
+    src/arch/aarch64/gic.c
+    src/arch/aarch64/paging.c
+    src/arch/aarch64/secondary.S
+    src/arch/aarch64/smp.c
+    src/arch/aarch64/timer.c)
 
 option(AARCH64_QEMU_UART "Support for QEMU UART on Aarch64" CACHE)
+option(AARCH64_LSE "Use the ARMv8.1 atomic instructions on Aarch64" CACHE)
+option(AARCH64_PSCI_SMC "Call PSCI through SMC instead of HVC on Aarch64" CACHE)
+set(AARCH64_PAGE_SHIFT 12 CACHE STRING
+    "Translation granule on Aarch64: 12 (4 KiB), 14 (16 KiB) or 16 (64 KiB)")
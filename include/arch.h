@@ -1,6 +1,12 @@
 #ifndef _ARCH_H
 #define _ARCH_H
 
+#include <stdint.h>
+
 void arch_init(void);
+uint64_t arch_cycles(void);
+void arch_idle(void);
+uint64_t arch_irq_save(void);
+void arch_irq_restore(uint64_t flags);
 
 #endif //_ARCH_H
@@ -0,0 +1,16 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#ifdef KERNEL_BENCH
+
+#define BENCH_RUN() bench_run()
+
+void bench_run(void);
+
+#else //KERNEL_BENCH
+
+#define BENCH_RUN()
+
+#endif //KERNEL_BENCH
+
+#endif //_BENCH_H
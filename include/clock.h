@@ -0,0 +1,39 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <stdint.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+// Rates are converted as value * mult >> CLOCK_SHIFT, which keeps divisions
+// out of the clock read.
+#define CLOCK_SHIFT 32
+
+// Computes value * mul / div without overflowing for any value a clock
+// reaches in practice, as long as div * mul fits in 64 bits.
+static inline uint64_t clock_scale(uint64_t value, uint64_t mul, uint64_t div)
+{
+	return value / div * mul + value % div * mul / div;
+}
+
+// The factor clock_convert() needs to turn from_hz ticks into to_hz ticks.
+static inline uint64_t clock_mult(uint64_t from_hz, uint64_t to_hz)
+{
+	if (!from_hz)
+		return 0;
+	return clock_scale(1ULL << CLOCK_SHIFT, to_hz, from_hz);
+}
+
+static inline uint64_t clock_convert(uint64_t value, uint64_t mult)
+{
+	__extension__ typedef unsigned __int128 uint128_t;
+	return ((uint128_t)value * mult) >> CLOCK_SHIFT;
+}
+
+// Implemented by the architecture's clock source.
+void clock_init(void);
+uint64_t clock_monotonic_ns(void);
+
+#endif //_CLOCK_H
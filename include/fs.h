@@ -1,6 +1,7 @@
 #ifndef _FS_H
 #define _FS_H
 
+#include <paging.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -15,6 +16,8 @@ typedef struct {
 	int (*read)(void *data, char *out, size_t cursor, size_t n);
 	void *(*mkdir)(void *data, const char *path);
 	void *(*mkfile)(void *data, const char *path);
+	intptr_t (*mmap)(void *data, address_space *space, uintptr_t vaddr,
+			 uint64_t flags);
 } fs_driver;
 
 typedef enum {
@@ -45,6 +48,16 @@ static inline int fs_read(fs_node *node, char *out, size_t n)
 	return node->driver->read(node->data, out, node->cursor, n);
 }
 
+// Maps the whole file at the page-aligned vaddr without copying it and
+// returns the address of its first byte, which may lie past vaddr.
+static inline intptr_t fs_mmap(fs_node *node, address_space *space,
+			       uintptr_t vaddr, uint64_t flags)
+{
+	if (!node->driver->mmap)
+		return -1;
+	return node->driver->mmap(node->data, space, vaddr, flags);
+}
+
 fs_mount_point *fs_mount_point_for_path(const char *path, size_t *index);
 int fs_find_node(fs_node *node, const char *path);
 void fs_init(BootInfo *boot_info);
@@ -0,0 +1,27 @@
+#ifndef _IRQ_H
+#define _IRQ_H
+
+#include <percpu.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Interrupts are numbered the way the controller numbers them: by vector on
+// x86_64 and by interrupt ID on aarch64.
+#define IRQ_COUNT 1024
+
+typedef void (*irq_handler)(uint32_t irq, void *data);
+
+extern PERCPU uint64_t irq_unhandled_count;
+
+void irq_init(void);
+int irq_register(uint32_t irq, irq_handler handler, void *data);
+void irq_unregister(uint32_t irq);
+void irq_dispatch(uint32_t irq);
+
+// Implemented by the interrupt controller driver.
+bool irq_unmask(uint32_t irq);
+void irq_mask(uint32_t irq);
+void irq_set_priority(uint32_t irq, uint8_t priority);
+void irq_raise(uint32_t irq);
+
+#endif //_IRQ_H
@@ -0,0 +1,335 @@
+#ifndef _LOCK_H
+#define _LOCK_H
+
+#include <arch.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// With LOCK_STATS every lock counts how often it was taken, how often it
+// had to wait and for how many cycles. lock_stats_dump() lists every lock
+// taken so far.
+#ifdef LOCK_STATS
+
+typedef struct lock_stats lock_stats;
+struct lock_stats {
+	const char *name;
+	uint64_t acquired;
+	uint64_t contended;
+	uint64_t wait_cycles;
+	lock_stats *next;
+	bool listed;
+};
+
+#define LOCK_STATS_FIELD lock_stats stats;
+#define LOCK_STATS_INIT(n) , .stats = { .name = (n) }
+#define LOCK_STATS_DUMP() lock_stats_dump()
+
+// Called with the lock held, which keeps the counters consistent.
+void lock_stats_record(lock_stats *stats, uint64_t start);
+void lock_stats_dump(void);
+
+static inline uint64_t lock_stats_clock(void)
+{
+	return arch_cycles();
+}
+
+#else //LOCK_STATS
+
+#define LOCK_STATS_FIELD
+#define LOCK_STATS_INIT(n)
+#define LOCK_STATS_DUMP()
+
+static inline uint64_t lock_stats_clock(void)
+{
+	return 0;
+}
+
+#endif //LOCK_STATS
+
+// Uncontended acquisitions pass 0 as the start of the wait.
+#ifdef LOCK_STATS
+#define lock_stat(lock, start) lock_stats_record(&(lock)->stats, (start))
+#else
+#define lock_stat(lock, start) (void)(start)
+#endif
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__)
+	asm volatile("pause" ::: "memory");
+#elif defined(__aarch64__)
+	asm volatile("yield" ::: "memory");
+#endif
+}
+
+// Ticket lock: CPUs get the lock in the order they asked for it. Everyone
+// waiting spins on the same word, which is fine while few CPUs contend.
+typedef struct {
+	uint32_t next;
+	uint32_t owner;
+	LOCK_STATS_FIELD
+} spinlock;
+
+#define SPINLOCK_INIT(n) { .next = 0 LOCK_STATS_INIT(n) }
+
+static inline void spin_lock(spinlock *lock)
+{
+	uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) == ticket) {
+		lock_stat(lock, 0);
+		return;
+	}
+
+	uint64_t start = lock_stats_clock();
+	while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+		cpu_relax();
+	lock_stat(lock, start);
+}
+
+static inline bool spin_trylock(spinlock *lock)
+{
+	uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+	uint32_t ticket = owner;
+	if (!__atomic_compare_exchange_n(&lock->next, &ticket, owner + 1, false,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return false;
+	lock_stat(lock, 0);
+	return true;
+}
+
+// Only the holder writes the owner, so no atomic add is needed.
+static inline void spin_unlock(spinlock *lock)
+{
+	uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+	__atomic_store_n(&lock->owner, owner + 1, __ATOMIC_RELEASE);
+}
+
+// Locks that interrupt handlers take as well have to keep interrupts off
+// while held, or the handler could spin on its own CPU's lock.
+static inline uint64_t spin_lock_irqsave(spinlock *lock)
+{
+	uint64_t flags = arch_irq_save();
+	spin_lock(lock);
+	return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock *lock, uint64_t flags)
+{
+	spin_unlock(lock);
+	arch_irq_restore(flags);
+}
+
+// MCS lock: waiters queue up and each spins on the node it brought along,
+// so a handover only touches the cache line of the next CPU in line. The
+// node, usually on the caller's stack, has to stay around until the lock
+// is released.
+typedef struct mcs_node mcs_node;
+struct mcs_node {
+	mcs_node *next;
+	bool waiting;
+} __attribute__((aligned(64)));
+
+typedef struct {
+	mcs_node *tail;
+	LOCK_STATS_FIELD
+} mcs_lock;
+
+#define MCS_LOCK_INIT(n) { .tail = NULL LOCK_STATS_INIT(n) }
+
+static inline void mcs_acquire(mcs_lock *lock, mcs_node *node)
+{
+	node->next = NULL;
+	node->waiting = true;
+	mcs_node *prev = __atomic_exchange_n(&lock->tail, node,
+					     __ATOMIC_ACQ_REL);
+	if (!prev) {
+		lock_stat(lock, 0);
+		return;
+	}
+
+	uint64_t start = lock_stats_clock();
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&node->waiting, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	lock_stat(lock, start);
+}
+
+static inline void mcs_release(mcs_lock *lock, mcs_node *node)
+{
+	mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (!next) {
+		// Nobody queued up behind us unless the tail moved on, in
+		// which case the next node is about to be linked in.
+		mcs_node *tail = node;
+		if (__atomic_compare_exchange_n(&lock->tail, &tail, NULL, false,
+						__ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+			return;
+		while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+			cpu_relax();
+	}
+	__atomic_store_n(&next->waiting, false, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t mcs_acquire_irqsave(mcs_lock *lock, mcs_node *node)
+{
+	uint64_t flags = arch_irq_save();
+	mcs_acquire(lock, node);
+	return flags;
+}
+
+static inline void mcs_release_irqrestore(mcs_lock *lock, mcs_node *node,
+					  uint64_t flags)
+{
+	mcs_release(lock, node);
+	arch_irq_restore(flags);
+}
+
+// Reader-writer lock: any number of readers or a single writer. A waiting
+// writer keeps new readers out, so a steady stream of them cannot starve
+// it. Only writers are counted with LOCK_STATS.
+#define RWLOCK_READERS 0xFFFF
+#define RWLOCK_WAITER (1U << 16)
+#define RWLOCK_WAITERS (0x7FFFU << 16)
+#define RWLOCK_WRITER (1U << 31)
+
+typedef struct {
+	uint32_t state;
+	LOCK_STATS_FIELD
+} rwlock;
+
+#define RWLOCK_INIT(n) { .state = 0 LOCK_STATS_INIT(n) }
+
+static inline void read_lock(rwlock *lock)
+{
+	for (;;) {
+		uint32_t state =
+			__atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+		if (!(state & (RWLOCK_WRITER | RWLOCK_WAITERS)) &&
+		    __atomic_compare_exchange_n(&lock->state, &state,
+						state + 1, false,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return;
+		cpu_relax();
+	}
+}
+
+static inline void read_unlock(rwlock *lock)
+{
+	__atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+}
+
+static inline void write_lock(rwlock *lock)
+{
+	uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+	if (!state && __atomic_compare_exchange_n(&lock->state, &state,
+						  RWLOCK_WRITER, false,
+						  __ATOMIC_ACQUIRE,
+						  __ATOMIC_RELAXED)) {
+		lock_stat(lock, 0);
+		return;
+	}
+
+	uint64_t start = lock_stats_clock();
+	__atomic_fetch_add(&lock->state, RWLOCK_WAITER, __ATOMIC_RELAXED);
+	for (;;) {
+		state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+		if (!(state & (RWLOCK_WRITER | RWLOCK_READERS)) &&
+		    __atomic_compare_exchange_n(
+			    &lock->state, &state,
+			    (state - RWLOCK_WAITER) | RWLOCK_WRITER, false,
+			    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		cpu_relax();
+	}
+	lock_stat(lock, start);
+}
+
+static inline void write_unlock(rwlock *lock)
+{
+	__atomic_fetch_and(&lock->state, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t read_lock_irqsave(rwlock *lock)
+{
+	uint64_t flags = arch_irq_save();
+	read_lock(lock);
+	return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock *lock, uint64_t flags)
+{
+	read_unlock(lock);
+	arch_irq_restore(flags);
+}
+
+static inline uint64_t write_lock_irqsave(rwlock *lock)
+{
+	uint64_t flags = arch_irq_save();
+	write_lock(lock);
+	return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock *lock, uint64_t flags)
+{
+	write_unlock(lock);
+	arch_irq_restore(flags);
+}
+
+// Seqlock: readers never write to shared memory. They note the sequence,
+// read, and start over if a writer was at work in the meantime, which the
+// sequence being odd or having changed gives away. Writers are serialised
+// by a spinlock.
+typedef struct {
+	uint32_t sequence;
+	spinlock lock;
+} seqlock;
+
+#define SEQLOCK_INIT(n) { .sequence = 0, .lock = SPINLOCK_INIT(n) }
+
+static inline void write_seqlock(seqlock *lock)
+{
+	spin_lock(&lock->lock);
+	__atomic_store_n(&lock->sequence, lock->sequence + 1,
+			 __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_sequnlock(seqlock *lock)
+{
+	__atomic_store_n(&lock->sequence, lock->sequence + 1,
+			 __ATOMIC_RELEASE);
+	spin_unlock(&lock->lock);
+}
+
+static inline uint64_t write_seqlock_irqsave(seqlock *lock)
+{
+	uint64_t flags = arch_irq_save();
+	write_seqlock(lock);
+	return flags;
+}
+
+static inline void write_sequnlock_irqrestore(seqlock *lock, uint64_t flags)
+{
+	write_sequnlock(lock);
+	arch_irq_restore(flags);
+}
+
+static inline uint32_t read_seqbegin(seqlock *lock)
+{
+	uint32_t sequence;
+	while ((sequence = __atomic_load_n(&lock->sequence,
+					   __ATOMIC_ACQUIRE)) & 1)
+		cpu_relax();
+	return sequence;
+}
+
+static inline bool read_seqretry(seqlock *lock, uint32_t sequence)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&lock->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+#endif //_LOCK_H
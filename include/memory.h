@@ -1,14 +1,41 @@
 #ifndef _MEMORY_H
 #define _MEMORY_H
 
-#define PAGE_SIZE 4096
+// The granule is a build option on aarch64, x86_64 only has 4 KiB pages.
+#ifndef PAGE_SHIFT
+#define PAGE_SHIFT 12
+#endif
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+
+// The firmware counts memory in 4 KiB pages whatever the kernel's granule.
+#define EFI_PAGE_SIZE 4096
+
+#define PHYSMAP_BASE 0xffff800000000000
+
+typedef struct {
+	uint16_t refcount;
+	uint16_t used_entries;
+} frame_info;
 
 typedef struct {
 	uintptr_t base;
 	size_t length;
 	uint8_t *bitmap;
+	frame_info *frames;
 } memory;
 
+extern uintptr_t physmap_offset;
+
+static inline void *phys_to_virt(uintptr_t paddr)
+{
+	return (void *)(paddr + physmap_offset);
+}
+
+static inline uintptr_t virt_to_phys(const void *vaddr)
+{
+	return (uintptr_t)vaddr - physmap_offset;
+}
+
 void *memset(void *destination, int c, size_t num);
 size_t strlen(const char *str);
 char *memcpy(char *destination, const char *source, size_t n);
@@ -18,7 +45,15 @@ int memcmp(const char *str1, const char *str2, size_t n);
 int strcmp(const char *str1, const char *str2);
 char *strtok(char *str, const char *delimiters);
 intptr_t find_free_frames(size_t n);
+intptr_t find_free_frames_aligned(size_t n, size_t align);
+intptr_t find_free_frames_below(size_t n, uintptr_t limit);
 intptr_t set_frame_lock(uintptr_t frame, size_t n, bool lock);
+frame_info *frame_get_info(uintptr_t frame);
+uint16_t frame_refcount(uintptr_t frame);
+void frame_ref(uintptr_t frame);
+uint16_t frame_unref(uintptr_t frame);
 void page_frame_allocator_init(BootInfo *boot_info);
+void memory_map_ram(BootInfo *boot_info, uintptr_t offset);
+void physmap_init(BootInfo *boot_info);
 
 #endif //_MEMORY_H
@@ -1,18 +1,202 @@
 #ifndef _PAGING_H
 #define _PAGING_H
 
+#include <erikboot.h>
+#include <lock.h>
+#include <memory.h>
+#include <percpu.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KERNEL_HALF_BASE 0xffff800000000000
+
+// Every table fills a page with 8-byte entries.
+#define PAGE_TABLE_BITS (PAGE_SHIFT - 3)
+#define PAGE_TABLE_ENTRIES (1 << PAGE_TABLE_BITS)
+#define LARGE_PAGE_SIZE (1UL << (PAGE_SHIFT + PAGE_TABLE_BITS))
+#define HUGE_PAGE_SIZE (1UL << (PAGE_SHIFT + 2 * PAGE_TABLE_BITS))
+
 #define P_WRITE (1 << 0)
 #define P_USER (1 << 1)
+// Maps the page read-only and gives the writer its own copy on first write.
+#define P_COW (1 << 2)
+// Only fills a hole. If something is mapped there already it stays and the
+// map returns 1, the caller then still owns the frame it passed in.
+#define P_FILL (1 << 5)
+// The mapping holds a reference to the frame, dropped again on unmap. Only
+// the first frame of a large or huge page is counted.
+#define P_OWNED (1 << 6)
+
+// Memory types. Normal memory is write-back unless asked otherwise.
+#define P_CACHE_WB (0 << 3)
+#define P_CACHE_WT (1 << 3)
+#define P_CACHE_WC (2 << 3)
+#define P_CACHE_UC (3 << 3)
+#define P_CACHE_MASK (3 << 3)
 
 #define P_KERNEL_RO 0
 #define P_KERNEL_WRITE P_WRITE
 #define P_USER_RO P_USER
 #define P_USER_WRITE (P_USER | P_WRITE)
 
-extern uint64_t *tables;
+#define PAGING_WALK_CACHE_SIZE 16
+#define PAGING_FLUSH_THRESHOLD 32
+
+typedef struct {
+	uint32_t sequence;
+	uintptr_t tag;
+	uint64_t *entry;
+} paging_walk_cache;
+
+typedef struct vm_region vm_region;
+
+typedef struct address_space address_space;
+struct address_space {
+	uint64_t *tables;
+	uint64_t asid;
+	uint64_t asid_generation;
+	bool tlb_flush_pending;
+	// Faults only read the regions, so they take the lock shared. It must
+	// not be taken twice, a waiting writer keeps the second reader out.
+	rwlock regions_lock;
+	vm_region *regions;
+	// Held while the tables are changed. Maps into the kernel half take
+	// the kernel space's lock, whichever space they went through.
+	spinlock tables_lock;
+	paging_walk_cache large_cache[PAGING_WALK_CACHE_SIZE];
+	paging_walk_cache huge_cache[PAGING_WALK_CACHE_SIZE];
+};
+
+extern address_space kernel_space;
+// The space each CPU has loaded, read it with this_cpu_read().
+extern PERCPU address_space *current_space;
+extern uint64_t paging_table_frames;
+
+// Tables keep count of their present entries in the frame metadata, so
+// the ones left empty can be handed back.
+static inline void paging_account_entry(void *entry, int delta)
+{
+	frame_info *table =
+		frame_get_info(virt_to_phys(entry) & ~(PAGE_SIZE - 1));
+	if (table)
+		table->used_entries += delta;
+}
+
+// The walk caches remember where the table entry covering a large or huge
+// page lives, so translating addresses close to each other skips the
+// upper levels of the walk.
+static inline uintptr_t paging_walk_cache_tag(uintptr_t vaddr, size_t size)
+{
+	return vaddr / size + 1;
+}
+
+// Any CPU walking the space reads and fills the slots, without a lock. The
+// sequence of a slot is odd while it is written, and a reader that sees it
+// change meanwhile takes the lookup as a miss. The sequence read is handed
+// back for paging_walk_cache_unchanged().
+static inline uint64_t *paging_walk_cache_lookup(paging_walk_cache *cache,
+						 uintptr_t tag,
+						 uint32_t *sequence)
+{
+	paging_walk_cache *slot = &cache[tag % PAGING_WALK_CACHE_SIZE];
+	*sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+	if (*sequence & 1)
+		return NULL;
+	uintptr_t slot_tag = __atomic_load_n(&slot->tag, __ATOMIC_RELAXED);
+	uint64_t *entry = __atomic_load_n(&slot->entry, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != *sequence)
+		return NULL;
+	return slot_tag == tag ? entry : NULL;
+}
+
+// The tables a cached entry lives in may be freed as soon as the lookup
+// returns. The physmap keeps them readable, but what was read through the
+// entry only counts if the slot was not flushed meanwhile, which happens
+// before any table is freed.
+static inline bool paging_walk_cache_unchanged(paging_walk_cache *cache,
+					       uintptr_t tag,
+					       uint32_t sequence)
+{
+	paging_walk_cache *slot = &cache[tag % PAGING_WALK_CACHE_SIZE];
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+// Fails if another CPU is writing the slot already.
+static inline bool paging_walk_cache_store(paging_walk_cache *slot,
+					   uintptr_t tag, uint64_t *entry)
+{
+	uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+	if ((sequence & 1) ||
+	    !__atomic_compare_exchange_n(&slot->sequence, &sequence,
+					 sequence + 1, false, __ATOMIC_ACQUIRE,
+					 __ATOMIC_RELAXED))
+		return false;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->tag, tag, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->entry, entry, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+	return true;
+}
+
+// A fill that finds the slot busy is dropped, the slot is only a hint.
+static inline void paging_walk_cache_fill(paging_walk_cache *cache,
+					  uintptr_t tag, uint64_t *entry)
+{
+	paging_walk_cache_store(&cache[tag % PAGING_WALK_CACHE_SIZE], tag,
+				entry);
+}
+
+// Drops a reference to a page or block. A block goes back to the frame
+// allocator whole once its first frame is unused.
+static inline void paging_put_frames(uintptr_t frame, size_t size)
+{
+	if (!frame_unref(frame) && size > PAGE_SIZE)
+		set_frame_lock(frame + PAGE_SIZE, size / PAGE_SIZE - 1, false);
+}
+
+static inline bool paging_range_fits(uintptr_t vaddr, uintptr_t paddr,
+				     size_t left, size_t size)
+{
+	return !((vaddr | paddr) & (size - 1)) && left >= size;
+}
+
+static inline void paging_walk_cache_flush(address_space *space)
+{
+	for (size_t i = 0; i < PAGING_WALK_CACHE_SIZE; ++i) {
+		paging_walk_cache *large = &space->large_cache[i];
+		paging_walk_cache *huge = &space->huge_cache[i];
+		while (!paging_walk_cache_store(large, 0, NULL))
+			cpu_relax();
+		while (!paging_walk_cache_store(huge, 0, NULL))
+			cpu_relax();
+	}
+}
 
-void paging_map_page(uint64_t *tables, uintptr_t vaddr, uintptr_t paddr,
-		     uint64_t flags);
-void paging_unmap_page(uint64_t *tables, uintptr_t vaddr);
+void paging_init(BootInfo *boot_info);
+uint64_t *paging_create_table(void);
+void paging_free_table(uintptr_t table);
+void paging_reserve_refill(void);
+address_space *paging_create_space(void);
+address_space *paging_clone_space(address_space *parent);
+void paging_destroy_space(address_space *space);
+bool paging_resolve_cow(address_space *space, uintptr_t vaddr, bool user);
+void paging_switch(address_space *space);
+void paging_invalidate(address_space *space, uintptr_t vaddr);
+int paging_map_page(address_space *space, uintptr_t vaddr, uintptr_t paddr,
+		    uint64_t flags);
+int paging_map_large_page(address_space *space, uintptr_t vaddr,
+			  uintptr_t paddr, uint64_t flags);
+int paging_map_huge_page(address_space *space, uintptr_t vaddr,
+			 uintptr_t paddr, uint64_t flags);
+int paging_map_range(address_space *space, uintptr_t vaddr, uintptr_t paddr,
+		     size_t size, uint64_t flags);
+bool paging_large_page_unmapped(address_space *space, uintptr_t vaddr);
+bool paging_huge_pages_supported(void);
+void paging_unmap_page(address_space *space, uintptr_t vaddr);
+void paging_unmap_range(address_space *space, uintptr_t vaddr, size_t size);
+intptr_t paging_translate(address_space *space, uintptr_t vaddr);
 
 #endif //_PAGING_H
@@ -0,0 +1,73 @@
+#ifndef _PERCPU_H
+#define _PERCPU_H
+
+#include <smp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Variables defined with PERCPU land in the .percpu section, which is only
+// the template every CPU gets a copy of. Each CPU keeps the distance from
+// the template to its own copy in GS on x86_64 and in TPIDR_EL1 on aarch64,
+// so a variable is reached at its link address relative to that register.
+#define PERCPU __attribute__((section(".percpu")))
+
+#define percpu_ptr(var, id) \
+	((__typeof__(var) *)((uintptr_t)&(var) + cpus[id].percpu_offset))
+#define this_cpu_ptr(var) \
+	((__typeof__(var) *)((uintptr_t)&(var) + percpu_offset()))
+
+// Every copy holds its own offset, which is all x86_64 can read from GS.
+extern PERCPU uintptr_t percpu_self;
+
+// Reads, writes and adds take a single instruction on x86_64 and cannot be
+// torn by an interrupt on either architecture. They work on scalars only,
+// anything larger goes through this_cpu_ptr(). The value always sits in a
+// register, which gives the instruction its operand size.
+#if defined(__x86_64__)
+
+#define this_cpu_read(var)                     \
+	__extension__({                        \
+		__typeof__(var) __value;       \
+		asm volatile("mov %%gs:%1, %0" \
+			     : "=r"(__value)   \
+			     : "m"(var));      \
+		__value;                       \
+	})
+#define this_cpu_write(var, value)     \
+	asm volatile("mov %1, %%gs:%0" \
+		     : "=m"(var)       \
+		     : "r"((__typeof__(var))(value)))
+#define this_cpu_add(var, value)       \
+	asm volatile("add %1, %%gs:%0" \
+		     : "+m"(var)       \
+		     : "r"((__typeof__(var))(value)))
+
+static inline uintptr_t percpu_offset(void)
+{
+	return this_cpu_read(percpu_self);
+}
+
+#elif defined(__aarch64__)
+
+static inline uintptr_t percpu_offset(void)
+{
+	uintptr_t offset;
+	asm volatile("mrs %0, tpidr_el1;" : "=r"(offset));
+	return offset;
+}
+
+#define this_cpu_read(var) (*(volatile __typeof__(var) *)this_cpu_ptr(var))
+#define this_cpu_write(var, value) \
+	(*(volatile __typeof__(var) *)this_cpu_ptr(var) = (value))
+// Relaxed, as only this CPU and its interrupt handlers touch the copy.
+#define this_cpu_add(var, value) \
+	__atomic_fetch_add(this_cpu_ptr(var), (value), __ATOMIC_RELAXED)
+
+#endif
+
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+
+bool percpu_init(uint32_t id);
+void percpu_free(uint32_t id);
+
+#endif //_PERCPU_H
@@ -15,6 +15,12 @@ typedef struct {
 	void *data;
 } serial_device;
 
+#ifdef AARCH64_QEMU_UART
+#define QEMU_UART_BASE 0x9000000
+
+void pl011_remap(void);
+#endif
+
 void serial_init(void);
 void serial_putchar(char c);
 void serial_print(const char *str);
@@ -0,0 +1,31 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SMP_MAX_CPUS 64
+#define SMP_STACK_SIZE 0x4000
+
+typedef struct {
+	uint32_t id;
+	// From the .percpu template to this CPU's copy, see percpu.h.
+	uintptr_t percpu_offset;
+	// The local APIC ID on x86_64, the MPIDR affinity on aarch64.
+	uint64_t arch_id;
+	bool online;
+} cpu;
+
+extern cpu cpus[SMP_MAX_CPUS];
+extern uint32_t smp_cpu_count;
+
+cpu *this_cpu(void);
+void smp_cpu_enter(uint32_t id);
+void smp_cpu_online(void);
+bool smp_wait_online(cpu *c, uint64_t timeout);
+bool smp_wait_count(uint32_t count, uint64_t timeout);
+
+// Implemented by the architecture.
+void smp_init(void);
+
+#endif //_SMP_H
@@ -0,0 +1,86 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <lock.h>
+#include <percpu.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Asks the clock event device to stay quiet.
+#define CLOCKEVENT_OFF UINT64_MAX
+
+// High-resolution timers live in a binary min-heap of this many entries.
+#define TIMER_HEAP_SIZE 1024
+
+// Coarse timers live in a hierarchical wheel. Level 0 slots are 2^20 ns
+// (about a millisecond) wide, every further level is 8 times coarser. A
+// timeout thus runs late by at most an eighth of its delay, and the last
+// level reaches about 13 days out.
+#define TIMER_WHEEL_SHIFT 20
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVEL_BITS 3
+#define TIMER_WHEEL_LEVELS 9
+
+typedef struct timer timer;
+typedef struct timer_base timer_base;
+typedef void (*timer_callback)(timer *t);
+
+// Expiry times are in clock_monotonic_ns() time. A timer in the wheel sits
+// in a slot list, one in the heap keeps its position in index.
+struct timer {
+	uint64_t expires;
+	timer_callback callback;
+	void *data;
+	timer_base *base;
+	timer *next;
+	timer **pprev;
+	uint32_t index;
+	bool armed;
+	bool coarse;
+};
+
+// The timers of one CPU. Other CPUs only take the lock to cancel or move
+// a timer armed here.
+struct timer_base {
+	spinlock lock;
+	timer *heap[TIMER_HEAP_SIZE];
+	size_t heap_count;
+	timer *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	uint64_t wheel_pending[TIMER_WHEEL_LEVELS];
+	size_t wheel_count;
+	// The first level 0 tick the wheel has not run yet.
+	uint64_t wheel_clock;
+	uint64_t next_event;
+};
+
+// How late high-resolution timers ran, from their expiry to their callback.
+typedef struct {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t total;
+} timer_latency;
+
+// Both count for the CPU they are read on.
+extern PERCPU timer_latency timer_stats;
+extern PERCPU uint64_t timer_interrupt_count;
+
+void timer_init(void);
+void timer_cpu_init(void);
+int timer_add(timer *t, uint64_t expires);
+int timer_add_coarse(timer *t, uint64_t expires);
+void timer_cancel(timer *t);
+void timer_interrupt(void);
+void timer_stats_reset(void);
+
+// Implemented by the architecture's clock event driver. The device fires
+// once at the given time, so an idle CPU takes no interrupts at all.
+// clockevent_init() sets the device up on the boot CPU, every other CPU
+// then brings up its own with clockevent_cpu_init().
+bool clockevent_init(void);
+bool clockevent_cpu_init(void);
+void clockevent_program(uint64_t expires);
+
+#endif //_TIMER_H
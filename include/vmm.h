@@ -0,0 +1,50 @@
+#ifndef _VMM_H
+#define _VMM_H
+
+#include <paging.h>
+#include <percpu.h>
+
+#define VM_FAULT_WRITE (1 << 0)
+#define VM_FAULT_USER (1 << 1)
+#define VM_FAULT_PROTECTION (1 << 2)
+
+#define IOREMAP_BASE 0xffffe00000000000
+#define IOREMAP_SIZE 0x1000000000
+
+// Regions are kept in a red-black tree ordered by address. A region
+// without backing is filled with zeroed frames on first touch, otherwise
+// its pages come from the physically contiguous memory at backing. Large
+// regions without backing are filled a large page at a time where memory
+// allows.
+struct vm_region {
+	uintptr_t start;
+	uintptr_t end;
+	uint64_t flags;
+	uintptr_t backing;
+	bool large;
+	vm_region *left;
+	vm_region *right;
+	vm_region *parent;
+	bool red;
+};
+
+// Counted on the CPU that took the fault.
+extern PERCPU uint64_t vmm_fault_count;
+extern PERCPU uint64_t vmm_fault_cycles;
+extern PERCPU uint64_t vmm_cow_fault_count;
+extern PERCPU uint64_t vmm_large_fault_count;
+
+int vmm_add_region(address_space *space, vm_region *region);
+int vmm_map_physical(address_space *space, uintptr_t vaddr, uintptr_t paddr,
+		     size_t size, uint64_t flags);
+void vmm_remove_region(address_space *space, vm_region *region);
+vm_region *vmm_find_region(address_space *space, uintptr_t vaddr);
+vm_region *vmm_first_region(address_space *space);
+vm_region *vmm_next_region(vm_region *region);
+void *ioremap(uintptr_t paddr, size_t size, uint64_t flags);
+void iounmap(void *vaddr, size_t size);
+address_space *vmm_clone_space(address_space *parent);
+void vmm_destroy_space(address_space *space);
+bool vmm_handle_fault(uintptr_t vaddr, uint64_t fault);
+
+#endif //_VMM_H
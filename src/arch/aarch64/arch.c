@@ -1,9 +1,20 @@
 #include <arch.h>
 #include <debug.h>
+#include <vmm.h>
 
-extern char vector_table_el1;
+#define EC_DATA_ABORT_LOWER 0x24
+#define EC_DATA_ABORT 0x25
+
+#define ISS_WNR (1 << 6)
+#define ISS_DFSC(x) ((x) & 0x3F)
+#define DFSC_TRANSLATION 0x04
+#define DFSC_PERMISSION 0x0C
+#define DFSC_TYPE(x) ((x) & 0x3C)
+
+void smp_cpu_setup(uint32_t id);
 void get_ttbr0(void);
 void get_ttbr1(void);
+void asid_init(void);
 
 char *exception_names[] = { "unknown",
 			    0,
@@ -72,26 +83,70 @@ char *exception_names[] = { "unknown",
 
 void arch_init(void)
 {
-	asm volatile("msr vbar_el1, %0;"
-		     "isb;" ::"r"(&vector_table_el1));
+	smp_cpu_setup(0);
 
 	get_ttbr0();
 	get_ttbr1();
+	asid_init();
+}
+
+uint64_t arch_cycles(void)
+{
+	uint64_t cycles;
+	asm volatile("isb; mrs %0, cntvct_el0" : "=r"(cycles));
+	return cycles;
+}
+
+void arch_idle(void)
+{
+	asm volatile("wfi" ::: "memory");
+}
+
+uint64_t arch_irq_save(void)
+{
+	uint64_t flags;
+	asm volatile("mrs %0, daif; msr daifset, #2" : "=r"(flags)::"memory");
+	return flags;
+}
+
+void arch_irq_restore(uint64_t flags)
+{
+	asm volatile("msr daif, %0" ::"r"(flags) : "memory");
+}
+
+static bool handle_data_abort(uint8_t ec, uint64_t esr, uint64_t far)
+{
+	uint64_t dfsc = ISS_DFSC(esr);
+	uint64_t fault = 0;
+
+	if (DFSC_TYPE(dfsc) == DFSC_PERMISSION)
+		fault |= VM_FAULT_PROTECTION;
+	else if (DFSC_TYPE(dfsc) != DFSC_TRANSLATION)
+		return false;
+	if (esr & ISS_WNR)
+		fault |= VM_FAULT_WRITE;
+	if (ec == EC_DATA_ABORT_LOWER)
+		fault |= VM_FAULT_USER;
+
+	return vmm_handle_fault(far, fault);
 }
 
 void handle_synchronous_exception(uint64_t *frame)
 {
-	(void)frame;
 	uint64_t esr, elr, far;
 	asm volatile("mrs %0, esr_el1;" : "=r"(esr));
 	asm volatile("mrs %0, elr_el1;" : "=r"(elr));
 	asm volatile("mrs %0, far_el1;" : "=r"(far));
 	uint8_t ec = (esr >> 26) & 0x3F;
+	if ((ec == EC_DATA_ABORT || ec == EC_DATA_ABORT_LOWER) &&
+	    handle_data_abort(ec, esr, far))
+		return;
+
 	DEBUG_PRINTF("=== PANIC! ===\n"
 		     " - Unhandled %s @ %#016lX!\n",
 		     exception_names[ec], elr);
 	for (int i = 0; i < 15; ++i)
-		DEBUG_PRINTF("X%-2i : %016lX\n", i, frame[14 - i]);
+		DEBUG_PRINTF("X%-2i : %016lX\n", i, frame[i]);
 	if (ec == 0x25)
 		DEBUG_PRINTF("Fault address: %#016lX\n", far);
 	asm volatile("1: wfi; b 1b");
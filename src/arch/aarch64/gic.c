@@ -0,0 +1,320 @@
+#include <debug.h>
+#include <erikboot.h>
+#include <irq.h>
+#include <memory.h>
+#include <paging.h>
+#include <vmm.h>
+
+// Where QEMU's virt machine puts the GIC.
+#define GICD_BASE 0x08000000
+#define GICD_SIZE 0x10000
+#define GICC_BASE 0x08010000
+#define GICC_SIZE 0x10000
+#define GICR_BASE 0x080A0000
+#define GICR_SIZE 0xF60000
+
+#define GICD_CTLR 0x0000
+#define GICD_TYPER 0x0004
+#define GICD_IGROUPR 0x0080
+#define GICD_ISENABLER 0x0100
+#define GICD_ICENABLER 0x0180
+#define GICD_ISPENDR 0x0200
+#define GICD_IPRIORITYR 0x0400
+#define GICD_ITARGETSR 0x0800
+#define GICD_SGIR 0x0F00
+#define GICD_IROUTER 0x6000
+#define GICD_PIDR2 0xFFE8
+
+#define GICD_CTLR_ENABLE_GRP0 (1 << 0)
+#define GICD_CTLR_ENABLE_GRP1 (1 << 1)
+#define GICD_CTLR_ARE (1 << 4)
+#define GICD_CTLR_RWP (1U << 31)
+#define GICD_TYPER_LINES(x) ((((x) & 0x1F) + 1) * 32)
+#define GICD_PIDR2_ARCH(x) (((x) >> 4) & 0xF)
+#define GICD_SGIR_SELF (2 << 24)
+
+#define GICC_CTLR 0x0000
+#define GICC_PMR 0x0004
+#define GICC_IAR 0x000C
+#define GICC_EOIR 0x0010
+
+#define GICR_FRAME_SIZE 0x10000
+#define GICR_WAKER 0x0014
+#define GICR_TYPER 0x0008
+#define GICR_TYPER_VLPIS (1 << 1)
+#define GICR_TYPER_LAST (1 << 4)
+#define GICR_WAKER_SLEEP (1 << 1)
+#define GICR_WAKER_ASLEEP (1 << 2)
+
+// SGIs and PPIs are configured through the second frame of a redistributor.
+#define GICR_SGI_BASE 0x10000
+#define GICR_IGROUPR0 (GICR_SGI_BASE + 0x0080)
+#define GICR_ISENABLER0 (GICR_SGI_BASE + 0x0100)
+#define GICR_ICENABLER0 (GICR_SGI_BASE + 0x0180)
+#define GICR_ISPENDR0 (GICR_SGI_BASE + 0x0200)
+#define GICR_IPRIORITYR (GICR_SGI_BASE + 0x0400)
+
+#define ICC_SRE_ENABLE (1 << 0)
+#define ICC_SGI1R_INTID(x) ((uint64_t)(x) << 24)
+
+#define MPIDR_AFFINITY(x) ((x) & 0xFF00FFFFFF)
+#define MPIDR_AFF0(x) ((x) & 0xFF)
+#define MPIDR_AFF1(x) (((x) >> 8) & 0xFF)
+#define MPIDR_AFF2(x) (((x) >> 16) & 0xFF)
+#define MPIDR_AFF3(x) (((x) >> 32) & 0xFF)
+
+#define GIC_PRIVATE_IRQS 32
+#define GIC_SPURIOUS 1020
+#define GIC_IRQ_MASK 0x3FF
+#define GIC_DEFAULT_PRIORITY 0xA0
+#define GIC_LOWEST_PRIORITY 0xFF
+
+#define REG(base, offset) (*(volatile uint32_t *)((uintptr_t)(base) + (offset)))
+
+static void *gicd = NULL;
+static void *gicc = NULL;
+// Private interrupts are enabled in the redistributor of the CPU they
+// belong to, so each CPU keeps a pointer to its own.
+static PERCPU void *gicr = NULL;
+static void *gicr_base = NULL;
+static bool gic_v3 = false;
+static uint32_t gic_lines = 0;
+
+static uint64_t gic_mpidr(void)
+{
+	uint64_t mpidr;
+	asm volatile("mrs %0, mpidr_el1;" : "=r"(mpidr));
+	return mpidr;
+}
+
+static void gicd_wait(void)
+{
+	while (REG(gicd, GICD_CTLR) & GICD_CTLR_RWP)
+		;
+}
+
+// Finds the redistributor that belongs to the CPU we run on.
+static void *gicr_find(void *base)
+{
+	uint64_t mpidr = gic_mpidr();
+	uint64_t affinity = MPIDR_AFF3(mpidr) << 24 | MPIDR_AFF2(mpidr) << 16 |
+			    MPIDR_AFF1(mpidr) << 8 | MPIDR_AFF0(mpidr);
+	for (uintptr_t frame = (uintptr_t)base;
+	     frame < (uintptr_t)base + GICR_SIZE;) {
+		uint64_t typer = *(volatile uint64_t *)(frame + GICR_TYPER);
+		if (typer >> 32 == affinity)
+			return (void *)frame;
+		if (typer & GICR_TYPER_LAST)
+			break;
+		frame += (typer & GICR_TYPER_VLPIS ? 4 : 2) * GICR_FRAME_SIZE;
+	}
+	return NULL;
+}
+
+static void gic_dist_init(void)
+{
+	REG(gicd, GICD_CTLR) = 0;
+	if (gic_v3)
+		gicd_wait();
+
+	// Every shared interrupt starts out disabled and at the same
+	// priority. GICv3 delivers group 1 as IRQs, GICv2 group 0.
+	for (uint32_t irq = GIC_PRIVATE_IRQS; irq < gic_lines; irq += 32) {
+		REG(gicd, GICD_ICENABLER + irq / 8) = 0xFFFFFFFF;
+		if (gic_v3)
+			REG(gicd, GICD_IGROUPR + irq / 8) = 0xFFFFFFFF;
+	}
+	for (uint32_t irq = GIC_PRIVATE_IRQS; irq < gic_lines; ++irq)
+		*(volatile uint8_t *)((uintptr_t)gicd + GICD_IPRIORITYR + irq) =
+			GIC_DEFAULT_PRIORITY;
+
+	if (gic_v3) {
+		REG(gicd, GICD_CTLR) = GICD_CTLR_ARE | GICD_CTLR_ENABLE_GRP1;
+		gicd_wait();
+	} else {
+		REG(gicd, GICD_CTLR) = GICD_CTLR_ENABLE_GRP0;
+	}
+}
+
+static void gic_cpu_init(void *rd)
+{
+	if (!gic_v3) {
+		REG(gicc, GICC_PMR) = GIC_LOWEST_PRIORITY;
+		REG(gicc, GICC_CTLR) = 1;
+		return;
+	}
+
+	// Wake the redistributor before touching anything behind it.
+	REG(rd, GICR_WAKER) &= ~GICR_WAKER_SLEEP;
+	while (REG(rd, GICR_WAKER) & GICR_WAKER_ASLEEP)
+		;
+	REG(rd, GICR_ICENABLER0) = 0xFFFFFFFF;
+	REG(rd, GICR_IGROUPR0) = 0xFFFFFFFF;
+	for (uint32_t irq = 0; irq < GIC_PRIVATE_IRQS; ++irq)
+		*(volatile uint8_t *)((uintptr_t)rd + GICR_IPRIORITYR + irq) =
+			GIC_DEFAULT_PRIORITY;
+
+	uint64_t sre;
+	asm volatile("mrs %0, icc_sre_el1;" : "=r"(sre));
+	asm volatile("msr icc_sre_el1, %0;"
+		     "isb;" ::"r"(sre | ICC_SRE_ENABLE));
+	asm volatile("msr icc_pmr_el1, %0;"
+		     "msr icc_bpr1_el1, xzr;"
+		     "msr icc_igrpen1_el1, %1;"
+		     "isb;" ::"r"((uint64_t)GIC_LOWEST_PRIORITY),
+		     "r"(1ULL));
+}
+
+void irq_init(void)
+{
+	gicd = ioremap(GICD_BASE, GICD_SIZE, P_KERNEL_WRITE | P_CACHE_UC);
+	if (!gicd) {
+		DEBUG_PRINTF("gic: could not map the distributor\n");
+		return;
+	}
+
+	// The distributor tells which architecture version the GIC follows.
+	gic_v3 = GICD_PIDR2_ARCH(REG(gicd, GICD_PIDR2)) >= 3;
+	gic_lines = GICD_TYPER_LINES(REG(gicd, GICD_TYPER));
+	if (gic_lines > GIC_SPURIOUS)
+		gic_lines = GIC_SPURIOUS;
+
+	if (gic_v3) {
+		gicr_base = ioremap(GICR_BASE, GICR_SIZE,
+				    P_KERNEL_WRITE | P_CACHE_UC);
+		this_cpu_write(gicr,
+			       gicr_base ? gicr_find(gicr_base) : NULL);
+		if (!this_cpu_read(gicr)) {
+			DEBUG_PRINTF("gic: no redistributor for this CPU\n");
+			return;
+		}
+	} else {
+		gicc = ioremap(GICC_BASE, GICC_SIZE,
+			       P_KERNEL_WRITE | P_CACHE_UC);
+		if (!gicc) {
+			DEBUG_PRINTF("gic: could not map the CPU interface\n");
+			return;
+		}
+	}
+
+	gic_dist_init();
+	gic_cpu_init(this_cpu_read(gicr));
+	DEBUG_PRINTF("gic: GICv%i with %u interrupts\n", gic_v3 ? 3 : 2,
+		     gic_lines);
+	asm volatile("msr daifclr, #2;");
+}
+
+// Brings up the CPU interface of a secondary CPU. Its private interrupts
+// start out disabled, irq_unmask() run on the CPU enables them.
+void gic_secondary_init(void)
+{
+	if (!gicd || (gic_v3 && !gicr_base))
+		return;
+	void *rd = gic_v3 ? gicr_find(gicr_base) : NULL;
+	if (gic_v3 && !rd) {
+		DEBUG_PRINTF("gic: no redistributor for this CPU\n");
+		return;
+	}
+	this_cpu_write(gicr, rd);
+	gic_cpu_init(rd);
+	asm volatile("msr daifclr, #2;");
+}
+
+// Called from the IRQ vectors, which only save the registers a C function
+// may clobber. Everything pending is handled before returning.
+void handle_irq(void)
+{
+	for (;;) {
+		uint64_t iar;
+		if (gic_v3)
+			asm volatile("mrs %0, icc_iar1_el1;" : "=r"(iar));
+		else
+			iar = REG(gicc, GICC_IAR);
+
+		uint32_t irq = iar & GIC_IRQ_MASK;
+		if (irq >= GIC_SPURIOUS)
+			return;
+		irq_dispatch(irq);
+
+		if (gic_v3)
+			asm volatile("msr icc_eoir1_el1, %0;" ::"r"(iar));
+		else
+			REG(gicc, GICC_EOIR) = iar;
+	}
+}
+
+bool irq_unmask(uint32_t irq)
+{
+	if (!gicd || irq >= gic_lines)
+		return false;
+
+	uint32_t bit = 1U << (irq % 32);
+	if (irq < GIC_PRIVATE_IRQS && gic_v3) {
+		void *rd = this_cpu_read(gicr);
+		if (!rd)
+			return false;
+		REG(rd, GICR_ISENABLER0) = bit;
+		return true;
+	}
+
+	// Shared interrupts are taken by the CPU that asked for them.
+	if (irq >= GIC_PRIVATE_IRQS && gic_v3) {
+		*(volatile uint64_t *)((uintptr_t)gicd + GICD_IROUTER +
+				       irq * 8) = MPIDR_AFFINITY(gic_mpidr());
+	} else if (irq >= GIC_PRIVATE_IRQS) {
+		uint8_t self = *(volatile uint8_t *)((uintptr_t)gicd +
+						     GICD_ITARGETSR);
+		*(volatile uint8_t *)((uintptr_t)gicd + GICD_ITARGETSR + irq) =
+			self;
+	}
+	REG(gicd, GICD_ISENABLER + irq / 32 * 4) = bit;
+	return true;
+}
+
+void irq_mask(uint32_t irq)
+{
+	if (!gicd || irq >= gic_lines)
+		return;
+
+	uint32_t bit = 1U << (irq % 32);
+	if (irq < GIC_PRIVATE_IRQS && gic_v3)
+		REG(this_cpu_read(gicr), GICR_ICENABLER0) = bit;
+	else
+		REG(gicd, GICD_ICENABLER + irq / 32 * 4) = bit;
+}
+
+void irq_set_priority(uint32_t irq, uint8_t priority)
+{
+	if (!gicd || irq >= gic_lines)
+		return;
+
+	uintptr_t reg = irq < GIC_PRIVATE_IRQS && gic_v3 ?
+				(uintptr_t)this_cpu_read(gicr) +
+					GICR_IPRIORITYR + irq :
+				(uintptr_t)gicd + GICD_IPRIORITYR + irq;
+	*(volatile uint8_t *)reg = priority;
+}
+
+// SGIs are sent to this CPU, anything else is made pending.
+void irq_raise(uint32_t irq)
+{
+	if (!gicd || irq >= gic_lines)
+		return;
+
+	uint32_t bit = 1U << (irq % 32);
+	if (irq >= GIC_PRIVATE_IRQS || (irq >= 16 && !gic_v3)) {
+		REG(gicd, GICD_ISPENDR + irq / 32 * 4) = bit;
+	} else if (irq >= 16) {
+		REG(this_cpu_read(gicr), GICR_ISPENDR0) = bit;
+	} else if (gic_v3) {
+		uint64_t mpidr = gic_mpidr();
+		uint64_t sgi = ICC_SGI1R_INTID(irq) | MPIDR_AFF3(mpidr) << 48 |
+			       MPIDR_AFF2(mpidr) << 32 |
+			       MPIDR_AFF1(mpidr) << 16 |
+			       1 << (MPIDR_AFF0(mpidr) % 16);
+		asm volatile("msr icc_sgi1r_el1, %0;"
+			     "isb;" ::"r"(sgi));
+	} else {
+		REG(gicd, GICD_SGIR) = GICD_SGIR_SELF | irq;
+	}
+}
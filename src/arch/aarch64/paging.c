@@ -1,16 +1,61 @@
 #include <debug.h>
 #include <erikboot.h>
+#include <heap.h>
+#include <lock.h>
 #include <memory.h>
 #include <paging.h>
+#include <serial.h>
+#include <smp.h>
 
-#define PGD_INDEX(x) (((x) >> 39) & 0x1FF)
-#define PUD_INDEX(x) (((x) >> 30) & 0x1FF)
-#define PMD_INDEX(x) (((x) >> 21) & 0x1FF)
-#define PT_INDEX(x) (((x) >> 12) & 0x1FF)
+#if PAGE_SHIFT != 12 && PAGE_SHIFT != 14 && PAGE_SHIFT != 16
+#error "Aarch64 supports 4 KiB, 16 KiB and 64 KiB granules only"
+#endif
 
+// Both halves are 48 bits wide. With 64 KiB granules that takes only three
+// levels and the walk starts at the PUD, with 16 KiB granules the PGD is
+// left with two entries.
+#define PAGING_VA_BITS 48
+#define PAGING_FIRST_LEVEL (PAGE_SHIFT == 16 ? 1 : 0)
+#define PAGING_LEVEL_SHIFT(level) (PAGE_SHIFT + (3 - (level)) * PAGE_TABLE_BITS)
+#define PAGING_LEVEL_SIZE(level) (1UL << PAGING_LEVEL_SHIFT(level))
+#define PAGING_TOP_ENTRIES \
+	(1 << (PAGING_VA_BITS - PAGING_LEVEL_SHIFT(PAGING_FIRST_LEVEL)))
+#define PAGING_INDEX(level, x)                                    \
+	(((x) >> PAGING_LEVEL_SHIFT(level)) &                     \
+	 ((level) == PAGING_FIRST_LEVEL ? PAGING_TOP_ENTRIES - 1 : \
+					  PAGE_TABLE_ENTRIES - 1))
+
+#define PGD_INDEX(x) PAGING_INDEX(0, x)
+#define PUD_INDEX(x) PAGING_INDEX(1, x)
+#define PMD_INDEX(x) PAGING_INDEX(2, x)
+#define PT_INDEX(x) PAGING_INDEX(3, x)
+
+// How many entries make up a contiguous run depends on the granule.
+#if PAGE_SHIFT == 16
+#define PAGING_CONTIGUOUS_PAGES 32
+#define PAGING_CONTIGUOUS_BLOCKS 32
+#elif PAGE_SHIFT == 14
+#define PAGING_CONTIGUOUS_PAGES 128
+#define PAGING_CONTIGUOUS_BLOCKS 32
+#else
+#define PAGING_CONTIGUOUS_PAGES 16
+#define PAGING_CONTIGUOUS_BLOCKS 16
+#endif
+
+#define P_AARCH64_NG (1 << 9)
 #define P_AARCH64_AF (1 << 8)
+#define P_AARCH64_INNER_SHAREABLE (3 << 6)
 #define P_AARCH64_RO (1 << 5)
 #define P_AARCH64_USER (1 << 4)
+#define P_AARCH64_ATTR_MASK 0xCF
+
+// Upper attributes, counted from bit 52 of the descriptor.
+#define P_AARCH64_HIGH_CONTIGUOUS (1 << 0)
+#define P_AARCH64_HIGH_PXN (1 << 1)
+#define P_AARCH64_HIGH_UXN (1 << 2)
+#define P_AARCH64_HIGH_COW (1 << 3)
+#define P_AARCH64_HIGH_OWNED (1 << 4)
+#define P_AARCH64_HIGH_TABLE_RO (1 << 10)
 
 typedef struct {
 	union {
@@ -26,19 +71,190 @@ typedef struct {
 	};
 } PTE;
 
-uint64_t *tables = NULL;
+#define TABLE(entry) ((PTE *)phys_to_virt((entry).address << 12))
+
+#define TTBR1_BASE 0xffff000000000000
+
+#define TTBR_ASID_SHIFT 48
+#define TTBR_BADDR_MASK 0x0000FFFFFFFFFFFE
+
+#define TCR_T0SZ_MASK 0x3FULL
+#define TCR_T0SZ_48BIT 16ULL
+#define TCR_T1SZ_MASK (0x3FULL << 16)
+#define TCR_T1SZ_48BIT (16ULL << 16)
+#define TCR_TG0_MASK (3ULL << 14)
+#define TCR_TG1_MASK (3ULL << 30)
+#if PAGE_SHIFT == 16
+#define TCR_TG0 (1ULL << 14)
+#define TCR_TG1 (3ULL << 30)
+#elif PAGE_SHIFT == 14
+#define TCR_TG0 (2ULL << 14)
+#define TCR_TG1 (1ULL << 30)
+#endif
+#define TCR_A1 (1ULL << 22)
+#define TCR_AS (1ULL << 36)
+
+// Index 0 keeps the bootloader's normal memory attributes, the other
+// memory types get slots of their own at the top of MAIR_EL1.
+#define MAIR_INDEX_NC 5
+#define MAIR_INDEX_DEVICE 6
+#define MAIR_INDEX_WT 7
+#define MAIR_NORMAL_NC 0x44
+#define MAIR_DEVICE_NGNRE 0x04
+#define MAIR_NORMAL_WT 0xBB
+#define MAIR_ATTR(index, attr) ((uint64_t)(attr) << ((index) * 8))
+
+// The generation sits above the ASID, so one word tells both apart.
+#define ASID_BITS 16
+#define ASID_CONTEXT(space) \
+	((space)->asid_generation << ASID_BITS | (space)->asid)
+#define ASID_OF(context) ((context) & ((1 << ASID_BITS) - 1))
+
+#define MMFR0_ASIDBITS(x) (((x) >> 4) & 0xF)
+#define MMFR0_ASIDBITS_16 2
+#define MMFR0_TGRAN16(x) (((x) >> 20) & 0xF)
+#define MMFR0_TGRAN64(x) (((x) >> 24) & 0xF)
+
+address_space kernel_space = { .regions_lock = RWLOCK_INIT("regions"),
+				.tables_lock = SPINLOCK_INIT("tables") };
+PERCPU address_space *current_space = &kernel_space;
 uint64_t *ttbr1_el1 = NULL;
 
+static uint64_t asid_count = 1 << 8;
+static uint64_t asid_generation = 1;
+static uint64_t asid_next = 1;
+static uint8_t asid_map[(1 << ASID_BITS) / 8] = { 1 };
+static spinlock asid_lock = SPINLOCK_INIT("asid");
+
+// What each CPU has loaded into TTBR0, and what it had when the ASIDs were
+// last recycled, as ASID_CONTEXT() values. 0 is the kernel space.
+static PERCPU uint64_t asid_active = 0;
+static PERCPU uint64_t asid_reserved = 0;
+// The last generation this CPU flushed its TLB for.
+static PERCPU uint64_t asid_flushed = 1;
+
 void get_ttbr0(void)
 {
-	if (!tables)
-		asm volatile("mrs %0, ttbr0_el1;" : "=r"(tables));
+	if (!kernel_space.tables) {
+		uint64_t ttbr0;
+		asm volatile("mrs %0, ttbr0_el1;" : "=r"(ttbr0));
+		kernel_space.tables = (uint64_t *)(ttbr0 & TTBR_BADDR_MASK);
+	}
 }
 
 void get_ttbr1(void)
 {
-	if (!ttbr1_el1)
-		asm volatile("mrs %0, ttbr1_el1;" : "=r"(ttbr1_el1));
+	if (!ttbr1_el1) {
+		uint64_t ttbr1;
+		asm volatile("mrs %0, ttbr1_el1;" : "=r"(ttbr1));
+		ttbr1_el1 = (uint64_t *)(ttbr1 & TTBR_BADDR_MASK);
+	}
+}
+
+void asid_init(void)
+{
+	uint64_t mmfr0, tcr;
+	asm volatile("mrs %0, id_aa64mmfr0_el1;" : "=r"(mmfr0));
+	asm volatile("mrs %0, tcr_el1;" : "=r"(tcr));
+
+	// The ASID is always taken from TTBR0, the kernel lives in TTBR1 with
+	// global mappings.
+	tcr &= ~TCR_A1;
+	if (MMFR0_ASIDBITS(mmfr0) == MMFR0_ASIDBITS_16) {
+		tcr |= TCR_AS;
+		asid_count = 1 << 16;
+	}
+
+	// The kernel space keeps ASID 0 for its whole lifetime.
+	asm volatile("msr tcr_el1, %0;"
+		     "msr ttbr0_el1, %1;"
+		     "isb;"
+		     "tlbi vmalle1;"
+		     "dsb nsh;"
+		     "isb;" ::"r"(tcr),
+		     "r"(kernel_space.tables)
+		     : "memory");
+}
+
+static bool asid_test(uint64_t asid)
+{
+	return asid_map[asid / 8] & (1 << (asid % 8));
+}
+
+static void asid_set(uint64_t asid)
+{
+	asid_map[asid / 8] |= 1 << (asid % 8);
+}
+
+// A CPU may keep running with an ASID of the old generation for a long
+// time after the rollover. Its space keeps that ASID, so invalidations
+// broadcast for the space still reach the CPU, and nobody else gets it.
+static void asid_rollover(void)
+{
+	asid_generation++;
+	asid_next = 1;
+	memset(asid_map, 0, sizeof(asid_map));
+	asid_set(0);
+	for (uint32_t id = 0; id < SMP_MAX_CPUS; ++id) {
+		if (!cpus[id].online)
+			continue;
+		uint64_t active = __atomic_load_n(percpu_ptr(asid_active, id),
+						  __ATOMIC_RELAXED);
+		*percpu_ptr(asid_reserved, id) = active;
+		asid_set(ASID_OF(active));
+	}
+}
+
+static bool asid_is_reserved(uint64_t context)
+{
+	for (uint32_t id = 0; id < SMP_MAX_CPUS; ++id)
+		if (cpus[id].online &&
+		    *percpu_ptr(asid_reserved, id) == context)
+			return true;
+	return false;
+}
+
+static uint64_t asid_alloc(void)
+{
+	for (int round = 0; round < 2; ++round) {
+		for (; asid_next < asid_count; ++asid_next)
+			if (!asid_test(asid_next))
+				return asid_next++;
+		// Once the ASIDs run out, start a new generation.
+		asid_rollover();
+	}
+	return 0;
+}
+
+// Returns the ASID to load the space with.
+static uint64_t asid_assign(address_space *space)
+{
+	uint64_t flags = spin_lock_irqsave(&asid_lock);
+	if (space->asid_generation != asid_generation) {
+		if (space->asid_generation &&
+		    asid_is_reserved(ASID_CONTEXT(space))) {
+			asid_set(space->asid);
+		} else {
+			space->asid = asid_alloc();
+			space->tlb_flush_pending = false;
+		}
+		space->asid_generation = asid_generation;
+	}
+	uint64_t asid = space->asid;
+	uint64_t generation = asid_generation;
+	this_cpu_write(asid_active, ASID_CONTEXT(space));
+	spin_unlock_irqrestore(&asid_lock, flags);
+
+	// Other CPUs only drop what they hold under recycled ASIDs the first
+	// time they load one of the new generation. An ASID new to the
+	// generation then has no stale entries left anywhere it runs.
+	if (this_cpu_read(asid_flushed) != generation) {
+		asm volatile("tlbi vmalle1;"
+			     "dsb nsh;"
+			     "isb;" ::: "memory");
+		this_cpu_write(asid_flushed, generation);
+	}
+	return asid;
 }
 
 uint64_t paging_flags_to_arch(uint64_t flags)
@@ -46,101 +262,1070 @@ uint64_t paging_flags_to_arch(uint64_t flags)
 	uint64_t arch_flags = P_AARCH64_AF;
 	if (flags & P_USER)
 		arch_flags |= P_AARCH64_USER;
-	if (!(flags & P_WRITE))
+	if (!(flags & P_WRITE) || (flags & P_COW))
 		arch_flags |= P_AARCH64_RO;
+
+	switch (flags & P_CACHE_MASK) {
+	case P_CACHE_WT:
+		arch_flags |= MAIR_INDEX_WT;
+		break;
+	case P_CACHE_WC:
+		arch_flags |= MAIR_INDEX_NC;
+		break;
+	case P_CACHE_UC:
+		arch_flags |= MAIR_INDEX_DEVICE;
+		break;
+	}
+
+	// Normal memory is shared with the other CPUs, which their atomics
+	// and the cache coherency between them rely on. Device memory is
+	// always treated as shareable.
+	if ((flags & P_CACHE_MASK) != P_CACHE_UC)
+		arch_flags |= P_AARCH64_INNER_SHAREABLE;
 	return arch_flags;
 }
 
-uint64_t *paging_create_table(void)
+static uint64_t paging_flags_to_arch_high(uint64_t flags)
+{
+	uint64_t arch_flags = 0;
+	if (flags & P_COW)
+		arch_flags |= P_AARCH64_HIGH_COW;
+	if (flags & P_OWNED)
+		arch_flags |= P_AARCH64_HIGH_OWNED;
+
+	// Nothing may be fetched from device memory, not even speculatively.
+	if ((flags & P_CACHE_MASK) == P_CACHE_UC)
+		arch_flags |= P_AARCH64_HIGH_PXN | P_AARCH64_HIGH_UXN;
+	return arch_flags;
+}
+
+address_space *paging_create_space(void)
+{
+	address_space *space = malloc(sizeof(address_space));
+	if (!space)
+		return NULL;
+
+	space->tables = paging_create_table();
+	if (!space->tables) {
+		free(space);
+		return NULL;
+	}
+
+	// The kernel lives behind TTBR1, its TTBR0 tables only hold the
+	// identity map and are not shared, mapping into them would write to
+	// the kernel's tables.
+	space->asid = 0;
+	space->asid_generation = 0;
+	space->tlb_flush_pending = false;
+	space->regions_lock = (rwlock)RWLOCK_INIT("regions");
+	space->regions = NULL;
+	space->tables_lock = (spinlock)SPINLOCK_INIT("tables");
+	paging_walk_cache_flush(space);
+	return space;
+}
+
+void paging_switch(address_space *space)
+{
+	if (space == this_cpu_read(current_space))
+		return;
+
+	uint64_t asid = 0;
+	if (space != &kernel_space)
+		asid = asid_assign(space) << TTBR_ASID_SHIFT;
+	else
+		this_cpu_write(asid_active, 0);
+
+	this_cpu_write(current_space, space);
+	asm volatile("msr ttbr0_el1, %0;"
+		     "isb;" ::"r"((uintptr_t)space->tables | asid)
+		     : "memory");
+
+	if (space->tlb_flush_pending) {
+		space->tlb_flush_pending = false;
+		asm volatile("dsb ishst;"
+			     "tlbi aside1, %0;"
+			     "dsb nsh;"
+			     "isb;" ::"r"(asid)
+			     : "memory");
+	}
+}
+
+void paging_invalidate(address_space *space, uintptr_t vaddr)
+{
+	uint64_t page = (vaddr >> 12) & 0xFFFFFFFFFFF;
+
+	if (space == &kernel_space || vaddr >= TTBR1_BASE) {
+		asm volatile("dsb ishst;"
+			     "tlbi vaae1is, %0;"
+			     "dsb ish;"
+			     "isb;" ::"r"(page)
+			     : "memory");
+	} else if (space->asid_generation) {
+		// Broadcast by ASID, so other CPUs running the space or still
+		// holding its entries drop them too before the frame is reused.
+		asm volatile("dsb ishst;"
+			     "tlbi vae1is, %0;"
+			     "dsb ish;"
+			     "isb;" ::"r"(page | space->asid << TTBR_ASID_SHIFT)
+			     : "memory");
+	}
+}
+
+// TTBR1 is the same for every space, so its tables go by the kernel space's
+// lock.
+static spinlock *paging_tables_lock(address_space *space, uintptr_t vaddr)
+{
+	return vaddr >= TTBR1_BASE ? &kernel_space.tables_lock :
+				     &space->tables_lock;
+}
+
+static bool paging_break_cow(PTE *entry, int level, bool leaf);
+
+static PTE *paging_next_table(address_space *space, PTE *entry, int level,
+			      bool create)
 {
-	uintptr_t table = find_free_frames(1);
+	if (entry->present) {
+		if (!entry->table_block)
+			return NULL;
+
+		// Mapping into a table shared with a clone would show up in
+		// the clone too, so it is made private first.
+		if (create && (entry->attributes_high & P_AARCH64_HIGH_COW)) {
+			if (!paging_break_cow(entry, level, false))
+				return NULL;
+			paging_walk_cache_flush(space);
+		}
+		return TABLE(*entry);
+	}
+
+	if (!create)
+		return NULL;
+
+	uintptr_t table = (uintptr_t)paging_create_table();
 	if (!table)
 		return NULL;
-	set_frame_lock(table, 1, true);
-	memset((char *)table, 0, PAGE_SIZE);
-	return (uint64_t *)table;
-}
-
-void paging_map_page(uint64_t *tables, uintptr_t vaddr, uintptr_t paddr,
-		     uint64_t flags)
-{
-	uint64_t pgd_index = PGD_INDEX(vaddr);
-	uint64_t pud_index = PUD_INDEX(vaddr);
-	uint64_t pmd_index = PMD_INDEX(vaddr);
-	uint64_t pt_index = PT_INDEX(vaddr);
-
-	PTE *pmd;
-	if (vaddr < 0xfffffffff8000000) {
-		PTE *pgd = (PTE *)tables;
-
-		PTE *pud;
-		if (pgd[pgd_index].present)
-			pud = (PTE *)(pgd[pgd_index].address << 12);
-		else {
-			pud = (PTE *)paging_create_table();
-			pgd[pgd_index].present = true;
-			pgd[pgd_index].table_block = true;
-			pgd[pgd_index].address = (uintptr_t)pud >> 12;
+	entry->value = 0;
+	entry->present = true;
+	entry->table_block = true;
+	entry->address = table >> 12;
+	paging_account_entry(entry, 1);
+	return TABLE(*entry);
+}
+
+static PTE *paging_get_pud(address_space *space, uintptr_t vaddr, bool create)
+{
+	uintptr_t root = vaddr >= TTBR1_BASE ? (uintptr_t)ttbr1_el1 :
+					       (uintptr_t)space->tables;
+	PTE *pgd = phys_to_virt(root);
+	if (PAGING_FIRST_LEVEL == 1)
+		return pgd;
+	return paging_next_table(space, &pgd[PGD_INDEX(vaddr)], 0, create);
+}
+
+static PTE *paging_get_pmd(address_space *space, uintptr_t vaddr, bool create)
+{
+	PTE *pud = paging_get_pud(space, vaddr, create);
+	if (!pud)
+		return NULL;
+	return paging_next_table(space, &pud[PUD_INDEX(vaddr)], 1, create);
+}
+
+static intptr_t paging_leaf_address(PTE *entry, size_t size, uintptr_t vaddr)
+{
+	if (!entry)
+		return -1;
+	return ((entry->address << 12) & ~(size - 1)) + (vaddr & (size - 1));
+}
+
+static void paging_set_block(PTE *block, uintptr_t paddr, uint64_t arch_flags)
+{
+	if (!block->present)
+		paging_account_entry(block, 1);
+	block->value = 0;
+	block->present = true;
+	block->attributes_low = arch_flags;
+	block->address = paddr >> 12;
+}
+
+static size_t paging_contiguous_entries(size_t size)
+{
+	return size == PAGE_SIZE ? PAGING_CONTIGUOUS_PAGES :
+				   PAGING_CONTIGUOUS_BLOCKS;
+}
+
+// Entries of a contiguous run may only change together, so the run is
+// turned back into single entries first. Dropping the hint needs
+// break-before-make on the whole run.
+static void paging_split_contiguous(address_space *space, PTE *entry,
+				    uintptr_t vaddr, size_t size)
+{
+	if (!entry->present ||
+	    !(entry->attributes_high & P_AARCH64_HIGH_CONTIGUOUS))
+		return;
+
+	size_t count = paging_contiguous_entries(size);
+	PTE *first = entry - (vaddr / size) % count;
+	uintptr_t start = vaddr & ~(size * count - 1);
+	PTE run[PAGING_CONTIGUOUS_PAGES];
+	for (size_t i = 0; i < count; ++i) {
+		run[i] = first[i];
+		first[i].value = 0;
+	}
+	for (size_t i = 0; i < count; ++i)
+		paging_invalidate(space, start + i * size);
+	for (size_t i = 0; i < count; ++i) {
+		run[i].attributes_high &= ~P_AARCH64_HIGH_CONTIGUOUS;
+		first[i] = run[i];
+	}
+}
+
+static void paging_set_leaf(address_space *space, PTE *entry, uintptr_t vaddr,
+			    size_t size, uintptr_t paddr, uint64_t flags)
+{
+	// Mappings private to a space are tagged with its ASID so they survive
+	// switching to another space and back.
+	uint64_t arch_flags = paging_flags_to_arch(flags);
+	if (space != &kernel_space && vaddr < TTBR1_BASE)
+		arch_flags |= P_AARCH64_NG;
+
+	paging_split_contiguous(space, entry, vaddr, size);
+	if (flags & P_OWNED)
+		frame_ref(paddr & ~(size - 1));
+	paging_set_block(entry, paddr & ~(size - 1), arch_flags);
+	entry->table_block = size == PAGE_SIZE;
+	entry->attributes_high = paging_flags_to_arch_high(flags);
+}
+
+// A hole a block filled in meanwhile is no error either.
+static int paging_fill_failed(PTE *entry, uint64_t flags)
+{
+	return (flags & P_FILL) && entry->present && !entry->table_block ?
+		       1 :
+		       -1;
+}
+
+// Blocks only go where nothing is mapped yet or over another block. Over a
+// table, the tables below would be lost along with everything they map.
+static int paging_block_conflict(PTE *entry, uint64_t flags)
+{
+	if (!entry->present)
+		return 0;
+	if (flags & P_FILL)
+		return 1;
+	return entry->table_block ? -1 : 0;
+}
+
+static int paging_map_page_locked(address_space *space, uintptr_t vaddr,
+				  uintptr_t paddr, uint64_t flags)
+{
+	PTE *pud = paging_get_pud(space, vaddr, true);
+	if (!pud)
+		return -1;
+	PTE *pmd = paging_next_table(space, &pud[PUD_INDEX(vaddr)], 1, true);
+	if (!pmd)
+		return paging_fill_failed(&pud[PUD_INDEX(vaddr)], flags);
+	PTE *pt = paging_next_table(space, &pmd[PMD_INDEX(vaddr)], 2, true);
+	if (!pt)
+		return paging_fill_failed(&pmd[PMD_INDEX(vaddr)], flags);
+
+	PTE *pte = &pt[PT_INDEX(vaddr)];
+	if (pte->present && (flags & P_FILL))
+		return 1;
+	paging_set_leaf(space, pte, vaddr, PAGE_SIZE, paddr, flags);
+	asm volatile("isb;");
+	return 0;
+}
+
+static int paging_map_large_page_locked(address_space *space, uintptr_t vaddr,
+					uintptr_t paddr, uint64_t flags)
+{
+	PTE *pud = paging_get_pud(space, vaddr, true);
+	if (!pud)
+		return -1;
+	PTE *pmd = paging_next_table(space, &pud[PUD_INDEX(vaddr)], 1, true);
+	if (!pmd)
+		return paging_fill_failed(&pud[PUD_INDEX(vaddr)], flags);
+
+	PTE *pmde = &pmd[PMD_INDEX(vaddr)];
+	int conflict = paging_block_conflict(pmde, flags);
+	if (conflict)
+		return conflict;
+	paging_set_leaf(space, pmde, vaddr, LARGE_PAGE_SIZE, paddr, flags);
+	asm volatile("isb;");
+	return 0;
+}
+
+static int paging_map_huge_page_locked(address_space *space, uintptr_t vaddr,
+				       uintptr_t paddr, uint64_t flags)
+{
+	if (!paging_huge_pages_supported())
+		return -1;
+
+	PTE *pud = paging_get_pud(space, vaddr, true);
+	if (!pud)
+		return -1;
+
+	PTE *pude = &pud[PUD_INDEX(vaddr)];
+	int conflict = paging_block_conflict(pude, flags);
+	if (conflict)
+		return conflict;
+	paging_set_leaf(space, pude, vaddr, HUGE_PAGE_SIZE, paddr, flags);
+	asm volatile("isb;");
+	return 0;
+}
+
+int paging_map_page(address_space *space, uintptr_t vaddr, uintptr_t paddr,
+		    uint64_t flags)
+{
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	int error = paging_map_page_locked(space, vaddr, paddr, flags);
+	spin_unlock_irqrestore(lock, irq);
+	return error;
+}
+
+int paging_map_large_page(address_space *space, uintptr_t vaddr,
+			  uintptr_t paddr, uint64_t flags)
+{
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	int error = paging_map_large_page_locked(space, vaddr, paddr, flags);
+	spin_unlock_irqrestore(lock, irq);
+	return error;
+}
+
+int paging_map_huge_page(address_space *space, uintptr_t vaddr,
+			 uintptr_t paddr, uint64_t flags)
+{
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	int error = paging_map_huge_page_locked(space, vaddr, paddr, flags);
+	spin_unlock_irqrestore(lock, irq);
+	return error;
+}
+
+// Only a hint, the tables may change as soon as it returns. Faults map with
+// P_FILL, which checks again under the lock.
+bool paging_large_page_unmapped(address_space *space, uintptr_t vaddr)
+{
+	PTE *pud = paging_get_pud(space, vaddr, false);
+	if (!pud)
+		return true;
+	PTE *pude = &pud[PUD_INDEX(vaddr)];
+	if (!pude->present)
+		return true;
+	if (!pude->table_block)
+		return false;
+	return !TABLE(*pude)[PMD_INDEX(vaddr)].present;
+}
+
+// Maps a run of pages or blocks the TLB may cache as a single entry. The
+// hint is only set on a run of empty entries, changing live ones would need
+// break-before-make.
+static int paging_map_contiguous(address_space *space, uintptr_t vaddr,
+				 uintptr_t paddr, size_t size, uint64_t flags)
+{
+	size_t count = paging_contiguous_entries(size);
+	PTE *table = paging_get_pmd(space, vaddr, true);
+	uint64_t index = PMD_INDEX(vaddr);
+	if (table && size == PAGE_SIZE) {
+		table = paging_next_table(space, &table[index], 2, true);
+		index = PT_INDEX(vaddr);
+	}
+	if (!table)
+		return -1;
+
+	PTE *run = &table[index];
+	bool empty = true;
+	for (size_t i = 0; i < count; ++i)
+		empty &= !run[i].present;
+	if (!empty && (flags & P_FILL))
+		return 1;
+
+	// Pages carry the table bit too, only blocks can land on a table.
+	for (size_t i = 0; size != PAGE_SIZE && i < count; ++i) {
+		if (paging_block_conflict(&run[i], flags))
+			return -1;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		paging_set_leaf(space, &run[i], vaddr + i * size,
+				size, paddr + i * size, flags);
+		if (empty)
+			run[i].attributes_high |= P_AARCH64_HIGH_CONTIGUOUS;
+	}
+	asm volatile("isb;");
+	return 0;
+}
+
+int paging_map_range(address_space *space, uintptr_t vaddr, uintptr_t paddr,
+		     size_t size, uint64_t flags)
+{
+	const size_t large_run = LARGE_PAGE_SIZE * PAGING_CONTIGUOUS_BLOCKS;
+	const size_t page_run = PAGE_SIZE * PAGING_CONTIGUOUS_PAGES;
+	const bool huge = paging_huge_pages_supported();
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	int error = 0;
+
+	for (size_t done = 0; done < size && !error;) {
+		uintptr_t v = vaddr + done;
+		uintptr_t p = paddr + done;
+		size_t left = size - done;
+
+		if (huge && paging_range_fits(v, p, left, HUGE_PAGE_SIZE)) {
+			error = paging_map_huge_page_locked(space, v, p, flags);
+			done += HUGE_PAGE_SIZE;
+		} else if (paging_range_fits(v, p, left, large_run)) {
+			error = paging_map_contiguous(space, v, p,
+						      LARGE_PAGE_SIZE, flags);
+			done += large_run;
+		} else if (paging_range_fits(v, p, left, LARGE_PAGE_SIZE)) {
+			error = paging_map_large_page_locked(space, v, p,
+							     flags);
+			done += LARGE_PAGE_SIZE;
+		} else if (paging_range_fits(v, p, left, page_run)) {
+			error = paging_map_contiguous(space, v, p, PAGE_SIZE,
+						      flags);
+			done += page_run;
+		} else {
+			error = paging_map_page_locked(space, v, p, flags);
+			done += PAGE_SIZE;
 		}
+	}
+	spin_unlock_irqrestore(lock, irq);
+	return error ? -1 : 0;
+}
 
-		if (pud[pud_index].present)
-			pmd = (PTE *)(pud[pud_index].address << 12);
-		else {
-			pmd = (PTE *)paging_create_table();
-			pud[pud_index].present = true;
-			pud[pud_index].table_block = true;
-			pud[pud_index].address = (uintptr_t)pud >> 12;
+// Level 1 blocks need 52-bit addresses with the larger granules.
+bool paging_huge_pages_supported(void)
+{
+	return PAGE_SHIFT == 12;
+}
+
+// Clears the entry mapping vaddr and frees the tables that leaves empty.
+// Returns the size of the region the walk stopped at, so callers can step
+// over whatever is not mapped.
+static size_t paging_clear(address_space *space, uintptr_t vaddr)
+{
+	bool kernel = space == &kernel_space || vaddr >= TTBR1_BASE;
+	uintptr_t root = vaddr >= TTBR1_BASE ? (uintptr_t)ttbr1_el1 :
+					       (uintptr_t)space->tables;
+	PTE *path[4];
+	PTE *entry = &((PTE *)phys_to_virt(
+		root))[PAGING_INDEX(PAGING_FIRST_LEVEL, vaddr)];
+	int level = PAGING_FIRST_LEVEL;
+	for (;; ++level) {
+		if (!entry->present)
+			return PAGING_LEVEL_SIZE(level);
+		if (level == 3 || !entry->table_block)
+			break;
+
+		// A table shared with a clone has to be made private first,
+		// which moves the entries the walk caches point at.
+		if (entry->attributes_high & P_AARCH64_HIGH_COW) {
+			if (!paging_break_cow(entry, level, false))
+				return PAGING_LEVEL_SIZE(level);
+			paging_walk_cache_flush(space);
 		}
-	} else {
-		pmd_index &= 0x3f;
-		pmd = (PTE *)ttbr1_el1;
+		path[level] = entry;
+		entry = &TABLE(*entry)[PAGING_INDEX(level + 1, vaddr)];
 	}
 
-	PTE *pt;
-	if (pmd[pmd_index].present) {
-		pt = (PTE *)(pmd[pmd_index].address << 12);
-	} else {
-		pt = (PTE *)paging_create_table();
-		pmd[pmd_index].present = true;
-		pmd[pmd_index].table_block = true;
-		pmd[pmd_index].address = (uintptr_t)pt >> 12;
+	size_t size = PAGING_LEVEL_SIZE(level);
+	paging_split_contiguous(space, entry, vaddr, size);
+	PTE leaf = *entry;
+	entry->value = 0;
+	paging_account_entry(entry, -1);
+
+	// The frame may only go once no TLB holds on to it any more.
+	if (leaf.attributes_high & P_AARCH64_HIGH_OWNED) {
+		paging_invalidate(space, vaddr);
+		paging_put_frames((leaf.address << 12) & ~(size - 1), size);
 	}
 
-	pt[pt_index].present = true;
-	pt[pt_index].table_block = true;
-	pt[pt_index].attributes_low = paging_flags_to_arch(flags);
-	pt[pt_index].address = paddr >> 12;
+	// The kernel's PUDs stay, as other spaces link to them.
+	for (int i = level - 1; i >= PAGING_FIRST_LEVEL; --i) {
+		if (i == PAGING_FIRST_LEVEL && kernel)
+			break;
+		uintptr_t table = path[i]->address << 12;
+		frame_info *info = frame_get_info(table);
+		if (!info || info->used_entries)
+			break;
+		path[i]->value = 0;
+		paging_account_entry(path[i], -1);
 
-	asm volatile("isb;");
+		// Walks cached through the table must be gone before it can be
+		// handed out again.
+		paging_walk_cache_flush(kernel ? &kernel_space : space);
+		paging_free_table(table);
+	}
+	return size;
+}
+
+void paging_unmap_page(address_space *space, uintptr_t vaddr)
+{
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	paging_clear(space, vaddr);
+
+	// Invalidating by address also drops the cached upper levels.
+	paging_invalidate(space, vaddr);
+	spin_unlock_irqrestore(lock, irq);
 }
 
-void paging_unmap_page(uint64_t *tables, uintptr_t vaddr)
+void paging_unmap_range(address_space *space, uintptr_t vaddr, size_t size)
 {
-	uint64_t pgd_index = PGD_INDEX(vaddr);
-	uint64_t pud_index = PUD_INDEX(vaddr);
-	uint64_t pmd_index = PMD_INDEX(vaddr);
-	uint64_t pt_index = PT_INDEX(vaddr);
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	uintptr_t end = vaddr + size;
+	for (uintptr_t page = vaddr; page < end;) {
+		size_t step = paging_clear(space, page);
+		page = (page & ~(step - 1)) + step;
+	}
 
-	PTE *pmd;
-	if (vaddr < 0xfffffffff8000000) {
-		PTE *pgd = (PTE *)tables;
+	// Past a handful of pages one flush beats invalidating each of them.
+	if (size / PAGE_SIZE <= PAGING_FLUSH_THRESHOLD) {
+		for (uintptr_t page = vaddr; page < end; page += PAGE_SIZE)
+			paging_invalidate(space, page);
+	} else if (space == &kernel_space || vaddr >= TTBR1_BASE) {
+		asm volatile("dsb ishst;"
+			     "tlbi vmalle1is;"
+			     "dsb ish;"
+			     "isb;" ::: "memory");
+	} else if (space->asid_generation) {
+		asm volatile("dsb ishst;"
+			     "tlbi aside1is, %0;"
+			     "dsb ish;"
+			     "isb;" ::"r"(space->asid << TTBR_ASID_SHIFT)
+			     : "memory");
+	}
+	spin_unlock_irqrestore(lock, irq);
+}
 
-		PTE *pud = (PTE *)(pgd[pgd_index].address << 12);
-		if (!pgd[pgd_index].present)
-			return;
+static intptr_t paging_translate_pmde(PTE pmde, uintptr_t vaddr)
+{
+	if (!pmde.present)
+		return -1;
+	if (!pmde.table_block)
+		return paging_leaf_address(&pmde, LARGE_PAGE_SIZE, vaddr);
+
+	PTE pte = TABLE(pmde)[PT_INDEX(vaddr)];
+	if (!pte.present)
+		return -1;
+	return paging_leaf_address(&pte, PAGE_SIZE, vaddr);
+}
+
+intptr_t paging_translate(address_space *space, uintptr_t vaddr)
+{
+	// TTBR1 is the same everywhere, so only the kernel space caches walks
+	// through it.
+	if (vaddr >= TTBR1_BASE)
+		space = &kernel_space;
 
-		pmd = (PTE *)(pud[pud_index].address << 12);
-		if (!pud[pud_index].present)
-			return;
-	} else {
-		pmd_index &= 0x3f;
-		pmd = (PTE *)ttbr1_el1;
+	// A cached entry only counts if its slot stayed the same while the
+	// walk went on through it, otherwise the walk starts over further up.
+	uint32_t sequence;
+	uintptr_t large_tag = paging_walk_cache_tag(vaddr, LARGE_PAGE_SIZE);
+	PTE *pmde = (PTE *)paging_walk_cache_lookup(space->large_cache,
+						    large_tag, &sequence);
+	if (pmde) {
+		intptr_t paddr = paging_translate_pmde(*pmde, vaddr);
+		if (paging_walk_cache_unchanged(space->large_cache, large_tag,
+						sequence))
+			return paddr;
 	}
 
-	PTE *pt = (PTE *)(pmd[pmd_index].address << 12);
-	if (!pmd[pmd_index].present)
+	uintptr_t huge_tag = paging_walk_cache_tag(vaddr, HUGE_PAGE_SIZE);
+	PTE *pude = (PTE *)paging_walk_cache_lookup(space->huge_cache,
+						    huge_tag, &sequence);
+	PTE entry = { .value = pude ? pude->value : 0 };
+	if (pude && !paging_walk_cache_unchanged(space->huge_cache, huge_tag,
+						 sequence))
+		pude = NULL;
+	if (!pude) {
+		PTE *pud = paging_get_pud(space, vaddr, false);
+		if (!pud)
+			return -1;
+		pude = &pud[PUD_INDEX(vaddr)];
+		entry = *pude;
+		paging_walk_cache_fill(space->huge_cache, huge_tag,
+				       &pude->value);
+	}
+
+	if (!entry.present)
+		return -1;
+	if (!entry.table_block)
+		return paging_leaf_address(&entry, HUGE_PAGE_SIZE, vaddr);
+
+	pmde = &TABLE(entry)[PMD_INDEX(vaddr)];
+	paging_walk_cache_fill(space->large_cache, large_tag, &pmde->value);
+	return paging_translate_pmde(*pmde, vaddr);
+}
+
+static bool paging_entry_writable(PTE *entry, bool leaf)
+{
+	if (leaf)
+		return !(entry->attributes_low & P_AARCH64_RO);
+	return !(entry->attributes_high & P_AARCH64_HIGH_TABLE_RO);
+}
+
+static void paging_set_writable(PTE *entry, bool leaf, bool writable)
+{
+	if (leaf && writable)
+		entry->attributes_low &= ~P_AARCH64_RO;
+	else if (leaf)
+		entry->attributes_low |= P_AARCH64_RO;
+	else if (writable)
+		entry->attributes_high &= ~P_AARCH64_HIGH_TABLE_RO;
+	else
+		entry->attributes_high |= P_AARCH64_HIGH_TABLE_RO;
+}
+
+// Marks an entry as shared by one more table. Writable entries become
+// read-only copy-on-write ones, read-only entries stay as they are. Table
+// entries are write protected through APTable, which covers everything
+// below them. Leaves the space does not own, like device memory, are shared
+// as they are.
+static void paging_share_entry(PTE *entry, bool leaf)
+{
+	if (!entry->present ||
+	    (leaf && !(entry->attributes_high & P_AARCH64_HIGH_OWNED)))
 		return;
+	if (paging_entry_writable(entry, leaf)) {
+		paging_set_writable(entry, leaf, false);
+		entry->attributes_high |= P_AARCH64_HIGH_COW;
+	}
+	frame_ref(entry->address << 12);
+}
 
-	pt[pt_index].present = false;
-	asm volatile("isb;");
+address_space *paging_clone_space(address_space *parent)
+{
+	address_space *child = paging_create_space();
+	if (!child)
+		return NULL;
+
+	// Only the top level is copied now. The tables below it are shared
+	// read-only and copied one level at a time as writes hit them, so a
+	// clone costs as much as the part of it that is written to.
+	uint64_t irq = spin_lock_irqsave(&parent->tables_lock);
+	PTE *from = phys_to_virt((uintptr_t)parent->tables);
+	PTE *to = phys_to_virt((uintptr_t)child->tables);
+	for (size_t i = 0; i < PAGING_TOP_ENTRIES; ++i) {
+		paging_share_entry(&from[i], false);
+		to[i] = from[i];
+	}
+
+	// Any CPU running the parent may still have writable translations
+	// cached.
+	if (parent->asid_generation)
+		asm volatile("dsb ishst;"
+			     "tlbi aside1is, %0;"
+			     "dsb ish;"
+			     "isb;" ::"r"(parent->asid << TTBR_ASID_SHIFT)
+			     : "memory");
+	spin_unlock_irqrestore(&parent->tables_lock, irq);
+	return child;
+}
+
+// Drops a space's hold on a table below the top level. Tables still shared
+// with a clone only lose a reference, the others are freed along with the
+// tables under them. Owned leaves drop their reference, which frees the
+// frames nobody else maps.
+static void paging_release_table(uintptr_t table, int level)
+{
+	if (frame_refcount(table) > 1) {
+		frame_unref(table);
+		return;
+	}
+
+	size_t size = PAGING_LEVEL_SIZE(level);
+	PTE *entries = phys_to_virt(table);
+	for (size_t i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		PTE entry = entries[i];
+		uintptr_t frame = entry.address << 12;
+		if (!entry.present)
+			continue;
+		if (level < 3 && entry.table_block)
+			paging_release_table(frame, level + 1);
+		else if (entry.attributes_high & P_AARCH64_HIGH_OWNED)
+			paging_put_frames(frame & ~(size - 1), size);
+	}
+	paging_free_table(table);
+}
+
+// The space must not be loaded on any CPU.
+void paging_destroy_space(address_space *space)
+{
+	PTE *top = phys_to_virt((uintptr_t)space->tables);
+	for (size_t i = 0; i < PAGING_TOP_ENTRIES; ++i) {
+		if (top[i].present)
+			paging_release_table(top[i].address << 12,
+					     PAGING_FIRST_LEVEL + 1);
+	}
+	paging_free_table((uintptr_t)space->tables);
+	free(space);
+}
+
+static bool paging_break_cow(PTE *entry, int level, bool leaf)
+{
+	size_t size = leaf ? PAGING_LEVEL_SIZE(level) : PAGE_SIZE;
+	uintptr_t frame = (entry->address << 12) & ~(size - 1);
+	if (frame_refcount(frame) > 1) {
+		intptr_t copy;
+		if (leaf) {
+			copy = find_free_frames_aligned(size / PAGE_SIZE, size);
+			if (copy < 0)
+				return false;
+			memcpy(phys_to_virt(copy), phys_to_virt(frame), size);
+		} else {
+			copy = (intptr_t)paging_create_table();
+			if (!copy)
+				return false;
+
+			// Both copies of the table now point at everything
+			// below.
+			PTE *old = phys_to_virt(frame);
+			PTE *new = phys_to_virt(copy);
+			for (size_t i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+				paging_share_entry(&old[i],
+						   level == 2 ||
+							   !old[i].table_block);
+				new[i] = old[i];
+			}
+			frame_info *from = frame_get_info(frame);
+			frame_info *to = frame_get_info(copy);
+			if (from && to)
+				to->used_entries = from->used_entries;
+		}
+		frame_unref(frame);
+		frame = copy;
+	}
+
+	// The last owner takes the frame over as it is.
+	entry->address = frame >> 12;
+	entry->attributes_high &= ~P_AARCH64_HIGH_COW;
+	paging_set_writable(entry, leaf, true);
+	return true;
+}
+
+bool paging_resolve_cow(address_space *space, uintptr_t vaddr, bool user)
+{
+	if (vaddr >= TTBR1_BASE)
+		return false;
+
+	uint64_t irq = spin_lock_irqsave(&space->tables_lock);
+	PTE *entry = &((PTE *)phys_to_virt((uintptr_t)space->tables))
+		[PAGING_INDEX(PAGING_FIRST_LEVEL, vaddr)];
+	bool broken = false;
+	bool resolved = false;
+	for (int level = PAGING_FIRST_LEVEL; level < 4; ++level) {
+		if (!entry->present)
+			break;
+
+		bool leaf = level == 3 || !entry->table_block;
+		if (user && leaf && !(entry->attributes_low & P_AARCH64_USER))
+			break;
+		size_t size = PAGING_LEVEL_SIZE(level);
+		if (entry->attributes_high & P_AARCH64_HIGH_COW) {
+			if (leaf)
+				paging_split_contiguous(space, entry, vaddr,
+							size);
+			if (!paging_break_cow(entry, level, leaf))
+				break;
+			broken = true;
+		} else if (!paging_entry_writable(entry, leaf)) {
+			break;
+		}
+
+		if (leaf) {
+			resolved = broken;
+			break;
+		}
+		entry = &TABLE(*entry)[PAGING_INDEX(level + 1, vaddr)];
+	}
+
+	// Tables copied on the way down moved entries even if the walk
+	// stopped short of the leaf.
+	if (broken) {
+		paging_walk_cache_flush(space);
+		paging_invalidate(space, vaddr);
+	}
+	spin_unlock_irqrestore(&space->tables_lock, irq);
+	return resolved;
+}
+
+#if PAGE_SHIFT == 12
+static PTE *paging_walk_pmd(PTE *pmd, uintptr_t vaddr, size_t *size)
+{
+	PTE *entry = &pmd[PMD_INDEX(vaddr)];
+	if (!entry->present)
+		return NULL;
+	if (!entry->table_block) {
+		*size = LARGE_PAGE_SIZE;
+		return entry;
+	}
+
+	entry = &TABLE(*entry)[PT_INDEX(vaddr)];
+	if (!entry->present)
+		return NULL;
+	*size = PAGE_SIZE;
+	return entry;
+}
+
+static void paging_copy_kernel(PTE *pmd, uintptr_t image, uintptr_t start,
+			       uintptr_t end)
+{
+	for (uintptr_t page = start; page < end; page += PAGE_SIZE) {
+		size_t size;
+		PTE *leaf = paging_walk_pmd(pmd, page, &size);
+		intptr_t from = paging_leaf_address(leaf, size, page);
+		char *to = phys_to_virt(image + page - start);
+		if (from < 0)
+			memset(to, 0, PAGE_SIZE);
+		else
+			memcpy(to, phys_to_virt(from), PAGE_SIZE);
+	}
+}
+
+static void paging_place_kernel(PTE *pmd, uintptr_t image, uintptr_t start,
+				uintptr_t data_start, uintptr_t end)
+{
+	for (uintptr_t page = start; page < end; page += LARGE_PAGE_SIZE) {
+		size_t size;
+		PTE leaf = { 0 };
+		PTE *entry = paging_walk_pmd(pmd, page, &size);
+		if (entry)
+			leaf = *entry;
+
+		PTE *block = &pmd[PMD_INDEX(page)];
+		paging_set_block(block, image + page - start,
+				 paging_flags_to_arch(page < data_start ?
+							      P_KERNEL_RO :
+							      P_KERNEL_WRITE));
+		block->attributes_low |= leaf.attributes_low &
+					 P_AARCH64_ATTR_MASK;
+		block->attributes_high = leaf.attributes_high;
+	}
+}
+
+// Hands back the frames and the table the bootloader mapped a block's
+// worth of the image with.
+static void paging_release_boot_mapping(PTE entry)
+{
+	if (!entry.present)
+		return;
+	if (!entry.table_block) {
+		set_frame_lock(entry.address << 12,
+			       LARGE_PAGE_SIZE / PAGE_SIZE, false);
+		return;
+	}
+
+	PTE *pt = TABLE(entry);
+	for (size_t i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		if (pt[i].present)
+			set_frame_lock(pt[i].address << 12, 1, false);
+	}
+	paging_free_table(entry.address << 12);
+}
+
+static void paging_build_ttbr1(void)
+{
+	extern char _kernel_start, _kernel_data_start, _kernel_end;
+	uintptr_t start = (uintptr_t)&_kernel_start;
+	uintptr_t data_start = (uintptr_t)&_kernel_data_start;
+	uintptr_t end = (uintptr_t)&_kernel_end;
+
+	// The bootloader's TTBR1 is a single 64-entry PMD covering the top
+	// 128 MiB. Build a full 48-bit table tree instead, with that PMD at its
+	// top end, so the direct map and everything else in the kernel half
+	// has room.
+	uintptr_t pgd = (uintptr_t)paging_create_table();
+	PTE *pud = NULL;
+	PTE *pmd = NULL;
+	if (pgd)
+		pud = paging_next_table(&kernel_space,
+					&((PTE *)phys_to_virt(pgd))[511], 0,
+					true);
+	if (pud)
+		pmd = paging_next_table(&kernel_space, &pud[511], 1, true);
+	if (!pmd) {
+		DEBUG_PRINTF("paging: no memory to build TTBR1\n");
+		for (;;)
+			;
+	}
+	PTE *boot_pmd = phys_to_virt((uintptr_t)ttbr1_el1);
+	memcpy((char *)&pmd[PMD_INDEX(start)], (char *)boot_pmd,
+	       64 * sizeof(PTE));
+
+	// The bootloader may have scattered the image over any frames, so move
+	// it somewhere block mappings can cover. Without such a spot the
+	// kernel keeps running on its 4 KiB mappings.
+	size_t frames = (end - start) / PAGE_SIZE;
+	intptr_t image = find_free_frames_aligned(frames, LARGE_PAGE_SIZE);
+
+	uint64_t tcr;
+	asm volatile("mrs %0, tcr_el1;" : "=r"(tcr));
+	tcr = (tcr & ~TCR_T1SZ_MASK) | TCR_T1SZ_48BIT;
+
+	// Nothing in the image may be written from here until TTBR1 points at
+	// the new tables, or the write is lost with the old copy. Replacing
+	// live table entries with blocks would need break-before-make on the
+	// code we are running, which is why the tables are swapped instead.
+	if (image >= 0) {
+		paging_copy_kernel(pmd, image, start, end);
+		paging_place_kernel(pmd, image, start, data_start, end);
+	}
+
+	asm volatile("dsb ishst;"
+		     "msr tcr_el1, %0;"
+		     "msr ttbr1_el1, %1;"
+		     "isb;"
+		     "tlbi vmalle1;"
+		     "ic iallu;"
+		     "dsb nsh;"
+		     "isb;" ::"r"(tcr),
+		     "r"(pgd)
+		     : "memory");
+
+	// Only the blocks over the new copy replaced what the bootloader
+	// mapped the image with. Without them its tables are still in use.
+	if (image >= 0) {
+		for (uintptr_t page = start; page < end;
+		     page += LARGE_PAGE_SIZE)
+			paging_release_boot_mapping(
+				boot_pmd[PMD_INDEX(page) - PMD_INDEX(start)]);
+	}
+	paging_free_table((uintptr_t)ttbr1_el1);
+	ttbr1_el1 = (uint64_t *)pgd;
+}
+#else
+static bool paging_granule_supported(void)
+{
+	uint64_t mmfr0;
+	asm volatile("mrs %0, id_aa64mmfr0_el1;" : "=r"(mmfr0));
+	if (PAGE_SHIFT == 16)
+		return MMFR0_TGRAN64(mmfr0) == 0;
+	return MMFR0_TGRAN16(mmfr0) != 0;
+}
+
+// The bootloader's tables are built for 4 KiB granules, so none of them can
+// be kept. Both halves are built anew: TTBR0 identity-maps RAM as before
+// and TTBR1 gets a copy of the kernel image. Mappings set up by the
+// bootloader for anything else are dropped.
+static void paging_switch_granule(BootInfo *boot_info)
+{
+	extern char _kernel_start, _kernel_data_start, _kernel_end;
+	uintptr_t start = (uintptr_t)&_kernel_start;
+	uintptr_t data_start = (uintptr_t)&_kernel_data_start;
+	uintptr_t end = (uintptr_t)&_kernel_end;
+
+	if (!paging_granule_supported()) {
+		DEBUG_PRINTF("paging: %i KiB granule not supported\n",
+			     PAGE_SIZE / 1024);
+		for (;;)
+			;
+	}
+
+	size_t frames = (end - start) / PAGE_SIZE;
+	intptr_t image = find_free_frames(frames);
+	uintptr_t pgd = (uintptr_t)paging_create_table();
+	uintptr_t identity = (uintptr_t)paging_create_table();
+	if (image < 0 || !pgd || !identity) {
+		DEBUG_PRINTF("paging: no memory to switch granules\n");
+		for (;;)
+			;
+	}
+
+	// The new tables are only written here, the old ones stay live until
+	// the switch below.
+	kernel_space.tables = (uint64_t *)identity;
+	ttbr1_el1 = (uint64_t *)pgd;
+	memory_map_ram(boot_info, 0);
+#ifdef AARCH64_QEMU_UART
+	paging_map_page(&kernel_space, QEMU_UART_BASE, QEMU_UART_BASE,
+			P_KERNEL_WRITE | P_CACHE_UC);
+#endif
+	paging_map_range(&kernel_space, start, image, data_start - start,
+			 P_KERNEL_RO);
+	paging_map_range(&kernel_space, data_start, image + data_start - start,
+			 end - data_start, P_KERNEL_WRITE);
+
+	uint64_t tcr;
+	asm volatile("mrs %0, tcr_el1;" : "=r"(tcr));
+	tcr &= ~(TCR_T0SZ_MASK | TCR_T1SZ_MASK | TCR_TG0_MASK | TCR_TG1_MASK);
+	tcr |= TCR_T0SZ_48BIT | TCR_T1SZ_48BIT | TCR_TG0 | TCR_TG1;
+
+	// As with 4 KiB granules, the image may not be written between the
+	// copy and the switch. Both halves change granule at the same time.
+	memcpy(phys_to_virt(image), (char *)start, end - start);
+	asm volatile("dsb ishst;"
+		     "msr tcr_el1, %0;"
+		     "msr ttbr0_el1, %1;"
+		     "msr ttbr1_el1, %2;"
+		     "isb;"
+		     "tlbi vmalle1;"
+		     "ic iallu;"
+		     "dsb nsh;"
+		     "isb;" ::"r"(tcr),
+		     "r"(identity), "r"(pgd)
+		     : "memory");
+}
+#endif
+
+// Tables the bootloader built were never counted, so take stock of every
+// table once the kernel's layout is in place.
+static void paging_account_tables(uintptr_t table, int level)
+{
+	PTE *entries = phys_to_virt(table);
+	size_t count = level == PAGING_FIRST_LEVEL ? PAGING_TOP_ENTRIES :
+						     PAGE_TABLE_ENTRIES;
+	uint16_t used = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (!entries[i].present)
+			continue;
+		used++;
+		if (level < 3 && entries[i].table_block)
+			paging_account_tables(entries[i].address << 12,
+					      level + 1);
+	}
+
+	frame_info *info = frame_get_info(table);
+	if (info)
+		info->used_entries = used;
+	paging_table_frames++;
+}
+
+static void paging_mair_init(void)
+{
+	uint64_t mair;
+	asm volatile("mrs %0, mair_el1;" : "=r"(mair));
+	mair &= ~(MAIR_ATTR(MAIR_INDEX_NC, 0xFF) |
+		  MAIR_ATTR(MAIR_INDEX_DEVICE, 0xFF) |
+		  MAIR_ATTR(MAIR_INDEX_WT, 0xFF));
+	mair |= MAIR_ATTR(MAIR_INDEX_NC, MAIR_NORMAL_NC) |
+		MAIR_ATTR(MAIR_INDEX_DEVICE, MAIR_DEVICE_NGNRE) |
+		MAIR_ATTR(MAIR_INDEX_WT, MAIR_NORMAL_WT);
+	asm volatile("msr mair_el1, %0;"
+		     "isb;" ::"r"(mair)
+		     : "memory");
+}
+
+void paging_init(BootInfo *boot_info)
+{
+	paging_mair_init();
+#if PAGE_SHIFT == 12
+	paging_build_ttbr1();
+#else
+	paging_switch_granule(boot_info);
+#endif
+	physmap_init(boot_info);
+#ifdef AARCH64_QEMU_UART
+	pl011_remap();
+#endif
+
+	paging_table_frames = 0;
+	paging_account_tables((uintptr_t)kernel_space.tables,
+			      PAGING_FIRST_LEVEL);
+	paging_account_tables((uintptr_t)ttbr1_el1, PAGING_FIRST_LEVEL);
 }
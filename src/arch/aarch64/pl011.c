@@ -1,4 +1,6 @@
+#include <paging.h>
 #include <serial.h>
+#include <vmm.h>
 
 #define DR_OFFSET 0x000
 #define FR_OFFSET 0x018
@@ -27,7 +29,7 @@ typedef struct {
 	uint32_t stop_bits;
 } pl011;
 
-pl011 _pl011_default = { 0x9000000, 24000000, 115200, 8, 1 };
+pl011 _pl011_default = { QEMU_UART_BASE, 24000000, 115200, 8, 1 };
 
 static void pl011_calculate_divisors(const pl011 *dev, uint32_t *integer,
 				     uint32_t *fractional)
@@ -82,6 +84,17 @@ void pl011_putchar(pl011 *dev, char c)
 	*REG(dev, DR_OFFSET) = c;
 }
 
+// The UART starts out in the identity map, which only the kernel space
+// has. Once ioremap() works it moves to the kernel half, where every space
+// reaches it.
+void pl011_remap(void)
+{
+	void *base = ioremap(QEMU_UART_BASE, PAGE_SIZE,
+			     P_KERNEL_WRITE | P_CACHE_UC);
+	if (base)
+		_pl011_default.base_address = (uintptr_t)base;
+}
+
 serial_driver pl011_driver = { (int (*)(void *))pl011_setup,
 			       (int (*)(void *))pl011_reset,
 			       (void (*)(void *, char))pl011_putchar };
@@ -0,0 +1,224 @@
+#include <arch.h>
+#include <clock.h>
+#include <debug.h>
+#include <erikboot.h>
+#include <memory.h>
+#include <paging.h>
+#include <percpu.h>
+#include <smp.h>
+#include <timer.h>
+
+#define PSCI_VERSION 0x84000000
+#define PSCI_CPU_ON 0xC4000003
+#define PSCI_VERSION_MAJOR(x) ((x) >> 16)
+
+#define PSCI_SUCCESS 0
+#define PSCI_NOT_SUPPORTED -1
+#define PSCI_INVALID_PARAMETERS -2
+#define PSCI_ALREADY_ON -4
+#define PSCI_INTERNAL_FAILURE -6
+
+#define MPIDR_AFFINITY(x) ((x) & 0xFF00FFFFFF)
+#define MPIDR_AFF1_SHIFT 8
+
+// A GICv3 target list reaches 16 CPUs per cluster, GICv2 only 8.
+#define SMP_CLUSTER_CPUS 16
+#define SMP_CLUSTERS 256
+#define SMP_STACK_FRAMES ((SMP_STACK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE)
+#define SMP_ONLINE_TIMEOUT (100 * NSEC_PER_MSEC)
+
+#define CTR_DMINLINE(x) (4 << (((x) >> 16) & 0xF))
+
+// Matches the offsets in secondary.S.
+typedef struct {
+	uint64_t mair;
+	uint64_t tcr;
+	uint64_t ttbr0;
+	uint64_t ttbr1;
+	uint64_t sctlr;
+	uint64_t cpacr;
+	uint64_t stack;
+	uint64_t entry;
+	uint64_t id;
+} __attribute__((aligned(64))) smp_boot_data;
+
+extern char vector_table_el1;
+extern char smp_secondary_entry[], smp_secondary_end[];
+
+void gic_secondary_init(void);
+
+static smp_boot_data smp_boot;
+
+static uint64_t smp_mpidr(void)
+{
+	uint64_t mpidr;
+	asm volatile("mrs %0, mpidr_el1;" : "=r"(mpidr));
+	return MPIDR_AFFINITY(mpidr);
+}
+
+// Installs the exception vectors of the calling CPU and points TPIDR_EL1
+// at its per-CPU data.
+void smp_cpu_setup(uint32_t id)
+{
+	asm volatile("msr vbar_el1, %0;"
+		     "msr tpidr_el1, %1;"
+		     "isb;" ::"r"(&vector_table_el1),
+		     "r"(cpus[id].percpu_offset)
+		     : "memory");
+	smp_cpu_enter(id);
+}
+
+[[noreturn]] static void smp_secondary_main(uint32_t id)
+{
+	smp_cpu_setup(id);
+	gic_secondary_init();
+	timer_cpu_init();
+	cpus[id].arch_id = smp_mpidr();
+	smp_cpu_online();
+
+	// As on the boot CPU, page tables come from a reserve filled here.
+	for (;;) {
+		paging_reserve_refill();
+		arch_idle();
+	}
+}
+
+// Function IDs and arguments go in x0-x3, the result comes back in x0.
+static int64_t psci_call(uint64_t function, uint64_t arg0, uint64_t arg1,
+			 uint64_t arg2)
+{
+	register uint64_t x0 asm("x0") = function;
+	register uint64_t x1 asm("x1") = arg0;
+	register uint64_t x2 asm("x2") = arg1;
+	register uint64_t x3 asm("x3") = arg2;
+#ifdef AARCH64_PSCI_SMC
+	asm volatile("smc #0"
+#else
+	asm volatile("hvc #0"
+#endif
+		     : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3)
+		     :
+		     : "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12",
+		       "x13", "x14", "x15", "x16", "x17", "memory");
+	return (int32_t)x0;
+}
+
+// The secondary CPU reads its boot data and runs its first instructions
+// with the MMU and caches off, so both have to reach memory first.
+static void smp_clean_dcache(void *start, size_t size)
+{
+	uint64_t ctr;
+	asm volatile("mrs %0, ctr_el0;" : "=r"(ctr));
+	uintptr_t line = CTR_DMINLINE(ctr);
+	for (uintptr_t p = (uintptr_t)start & ~(line - 1);
+	     p < (uintptr_t)start + size; p += line)
+		asm volatile("dc cvac, %0;" ::"r"(p) : "memory");
+	asm volatile("dsb sy;" ::: "memory");
+}
+
+// Returns the physical address of a kernel symbol, making sure the identity
+// map of TTBR0 covers it, as the secondary CPU keeps running there for a
+// few instructions after it turned on the MMU.
+static intptr_t smp_identity(void *symbol)
+{
+	intptr_t paddr = paging_translate(&kernel_space, (uintptr_t)symbol);
+	if (paddr < 0)
+		return -1;
+	uintptr_t page = paddr & ~(PAGE_SIZE - 1);
+	if (paging_translate(&kernel_space, page) != (intptr_t)page &&
+	    paging_map_page(&kernel_space, page, page, P_KERNEL_RO) < 0)
+		return -1;
+	return paddr;
+}
+
+static void smp_boot_setup(void)
+{
+	asm volatile("mrs %0, mair_el1;" : "=r"(smp_boot.mair));
+	asm volatile("mrs %0, tcr_el1;" : "=r"(smp_boot.tcr));
+	asm volatile("mrs %0, ttbr1_el1;" : "=r"(smp_boot.ttbr1));
+	asm volatile("mrs %0, sctlr_el1;" : "=r"(smp_boot.sctlr));
+	asm volatile("mrs %0, cpacr_el1;" : "=r"(smp_boot.cpacr));
+	smp_boot.ttbr0 = (uintptr_t)kernel_space.tables;
+	smp_boot.entry = (uintptr_t)smp_secondary_main;
+	smp_clean_dcache(smp_secondary_entry,
+			 smp_secondary_end - smp_secondary_entry);
+}
+
+// Starts the CPU with the given affinity into the next free slot and waits
+// for it. Returns what PSCI said about the affinity.
+static int64_t smp_start(uint64_t mpidr, uintptr_t entry, uintptr_t boot)
+{
+	uint32_t id = smp_cpu_count;
+	if (mpidr == cpus[0].arch_id)
+		return PSCI_ALREADY_ON;
+
+	intptr_t stack = find_free_frames(SMP_STACK_FRAMES);
+	if (stack < 0)
+		return PSCI_INTERNAL_FAILURE;
+	if (!percpu_init(id)) {
+		set_frame_lock(stack, SMP_STACK_FRAMES, false);
+		return PSCI_INTERNAL_FAILURE;
+	}
+	smp_boot.stack = (uintptr_t)phys_to_virt(stack) +
+			 SMP_STACK_FRAMES * PAGE_SIZE;
+	smp_boot.id = id;
+	smp_clean_dcache(&smp_boot, sizeof(smp_boot));
+
+	int64_t ret = psci_call(PSCI_CPU_ON, mpidr, entry, boot);
+	if (ret != PSCI_SUCCESS) {
+		set_frame_lock(stack, SMP_STACK_FRAMES, false);
+		percpu_free(id);
+		return ret;
+	}
+	if (!smp_wait_online(&cpus[id], SMP_ONLINE_TIMEOUT))
+		DEBUG_PRINTF("smp: CPU %#lx did not come up\n", mpidr);
+	return ret;
+}
+
+// Returns how many affinities of the cluster PSCI accepted, or -1 once no
+// more CPUs can be started.
+static int smp_start_cluster(uint64_t cluster, uintptr_t entry,
+			     uintptr_t boot)
+{
+	int core = 0;
+	for (; core < SMP_CLUSTER_CPUS; ++core) {
+		uint64_t mpidr = cluster << MPIDR_AFF1_SHIFT | core;
+		uint32_t id = smp_cpu_count;
+		int64_t ret = smp_start(mpidr, entry, boot);
+		if (ret == PSCI_INVALID_PARAMETERS)
+			break;
+		// A CPU that timed out may still read its boot data.
+		if (ret == PSCI_SUCCESS && !cpus[id].online)
+			return -1;
+		if (smp_cpu_count == SMP_MAX_CPUS)
+			return -1;
+	}
+	return core;
+}
+
+// There is no device tree to list the CPUs, so affinities are tried in
+// order, the way QEMU's virt machine numbers them: through Aff0 until PSCI
+// rejects one, then on to the next cluster. An empty cluster ends the
+// search.
+void smp_init(void)
+{
+	cpus[0].arch_id = smp_mpidr();
+	smp_cpu_online();
+
+	int64_t version = psci_call(PSCI_VERSION, 0, 0, 0);
+	intptr_t entry = smp_identity(smp_secondary_entry);
+	intptr_t boot = smp_identity(&smp_boot);
+	if (version == PSCI_NOT_SUPPORTED || !PSCI_VERSION_MAJOR(version) ||
+	    entry < 0 || boot < 0) {
+		DEBUG_PRINTF("smp: only the boot CPU is usable\n");
+		return;
+	}
+
+	smp_boot_setup();
+	uint64_t start = clock_monotonic_ns();
+	for (uint64_t cluster = 0; cluster < SMP_CLUSTERS; ++cluster)
+		if (smp_start_cluster(cluster, entry, boot) <= 0)
+			break;
+	DEBUG_PRINTF("smp: %u CPUs online after %lu us\n", smp_cpu_count,
+		     (clock_monotonic_ns() - start) / NSEC_PER_USEC);
+}
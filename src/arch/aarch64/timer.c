@@ -0,0 +1,77 @@
+#include <arch.h>
+#include <clock.h>
+#include <debug.h>
+#include <irq.h>
+#include <timer.h>
+
+// The EL1 virtual timer's private interrupt.
+#define TIMER_VIRTUAL_IRQ 27
+
+#define CNTV_CTL_ENABLE (1 << 0)
+#define CNTV_CTL_IMASK (1 << 1)
+
+static uint64_t counter_hz = 0;
+static uint64_t counter_base = 0;
+static uint64_t counter_to_ns = 0;
+static uint64_t ns_to_counter = 0;
+
+// The firmware sets CNTFRQ_EL0 to the rate of the system counter, which
+// arch_cycles() reads through the virtual count.
+void clock_init(void)
+{
+	asm volatile("mrs %0, cntfrq_el0" : "=r"(counter_hz));
+	counter_to_ns = clock_mult(counter_hz, NSEC_PER_SEC);
+	ns_to_counter = clock_mult(NSEC_PER_SEC, counter_hz);
+	counter_base = arch_cycles();
+	DEBUG_PRINTF("clock: generic timer at %lu kHz\n", counter_hz / 1000);
+}
+
+uint64_t clock_monotonic_ns(void)
+{
+	return clock_convert(arch_cycles() - counter_base, counter_to_ns);
+}
+
+static void timer_irq_handler(uint32_t irq, void *data)
+{
+	(void)irq;
+	(void)data;
+	timer_interrupt();
+}
+
+bool clockevent_init(void)
+{
+	if (!counter_hz)
+		return false;
+
+	asm volatile("msr cntv_ctl_el0, %0; isb" ::"r"(
+		(uint64_t)CNTV_CTL_IMASK));
+	if (irq_register(TIMER_VIRTUAL_IRQ, timer_irq_handler, NULL) < 0)
+		return false;
+	DEBUG_PRINTF("clock: virtual timer clock events\n");
+	return true;
+}
+
+// Every CPU has a timer and a redistributor of its own, so the interrupt
+// the boot CPU registered still has to be let through here.
+bool clockevent_cpu_init(void)
+{
+	asm volatile("msr cntv_ctl_el0, %0; isb" ::"r"(
+		(uint64_t)CNTV_CTL_IMASK));
+	return irq_unmask(TIMER_VIRTUAL_IRQ);
+}
+
+// The timer compares against the count itself, so a deadline in the past
+// fires at once. Its interrupt is level triggered and stays asserted until
+// the compare value moves or the timer is turned off.
+void clockevent_program(uint64_t expires)
+{
+	if (expires == CLOCKEVENT_OFF) {
+		asm volatile("msr cntv_ctl_el0, xzr; isb");
+		return;
+	}
+
+	uint64_t cval = counter_base + clock_convert(expires, ns_to_counter);
+	asm volatile("msr cntv_cval_el0, %0" ::"r"(cval));
+	asm volatile("msr cntv_ctl_el0, %0; isb" ::"r"(
+		(uint64_t)CNTV_CTL_ENABLE));
+}
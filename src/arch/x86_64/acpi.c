@@ -0,0 +1,109 @@
+#include <debug.h>
+#include <erikboot.h>
+#include <memory.h>
+#include <paging.h>
+#include <vmm.h>
+
+#include "acpi.h"
+
+#define EBDA_POINTER 0x40E
+#define EBDA_SCAN_SIZE 0x400
+#define BIOS_AREA 0xE0000
+#define BIOS_AREA_SIZE 0x20000
+#define RSDP_ALIGN 16
+
+typedef struct {
+	char signature[8];
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt;
+	uint32_t length;
+	uint64_t xsdt;
+	uint8_t extended_checksum;
+	uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp;
+
+static bool acpi_checksum(const void *data, size_t length)
+{
+	uint8_t sum = 0;
+	for (size_t i = 0; i < length; ++i)
+		sum += ((const uint8_t *)data)[i];
+	return sum == 0;
+}
+
+static void *acpi_map(uintptr_t paddr, size_t size)
+{
+	return ioremap(paddr, size, P_KERNEL_RO | P_CACHE_WB);
+}
+
+static uintptr_t acpi_scan(uintptr_t paddr, size_t size)
+{
+	char *area = acpi_map(paddr, size);
+	if (!area)
+		return 0;
+	for (size_t i = 0; i + sizeof(acpi_rsdp) <= size; i += RSDP_ALIGN) {
+		acpi_rsdp *rsdp = (acpi_rsdp *)(area + i);
+		if (!memcmp(rsdp->signature, "RSD PTR ", 8) &&
+		    acpi_checksum(rsdp, 20))
+			return paddr + i;
+	}
+	return 0;
+}
+
+// The boot protocol does not hand over the RSDP, so look for it where
+// legacy firmware leaves it: in the first KiB of the EBDA or in the BIOS
+// area below 1 MiB.
+static acpi_rsdp *acpi_find_rsdp(void)
+{
+	static acpi_rsdp *rsdp = NULL;
+	if (rsdp)
+		return rsdp;
+
+	uintptr_t found = 0;
+	uint16_t *ebda = acpi_map(EBDA_POINTER, sizeof(uint16_t));
+	if (ebda && *ebda)
+		found = acpi_scan((uintptr_t)*ebda << 4, EBDA_SCAN_SIZE);
+	if (!found)
+		found = acpi_scan(BIOS_AREA, BIOS_AREA_SIZE);
+	if (found)
+		rsdp = acpi_map(found, sizeof(acpi_rsdp));
+	return rsdp;
+}
+
+static acpi_header *acpi_map_table(uintptr_t paddr)
+{
+	acpi_header *header = acpi_map(paddr, sizeof(acpi_header));
+	if (!header)
+		return NULL;
+	acpi_header *table = acpi_map(paddr, header->length);
+	if (!table || !acpi_checksum(table, table->length))
+		return NULL;
+	return table;
+}
+
+// Returns the first table with the given signature, mapped for good.
+acpi_header *acpi_find_table(const char *signature)
+{
+	acpi_rsdp *rsdp = acpi_find_rsdp();
+	if (!rsdp)
+		return NULL;
+
+	// The XSDT holds 64-bit pointers, the RSDT of ACPI 1.0 32-bit ones.
+	bool xsdt = rsdp->revision >= 2 && rsdp->xsdt;
+	acpi_header *root = acpi_map_table(xsdt ? rsdp->xsdt : rsdp->rsdt);
+	if (!root)
+		return NULL;
+
+	size_t entry_size = xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+	size_t count = (root->length - sizeof(acpi_header)) / entry_size;
+	uint8_t *entries = (uint8_t *)(root + 1);
+	for (size_t i = 0; i < count; ++i) {
+		uintptr_t paddr = xsdt ? ((uint64_t *)entries)[i] :
+					 ((uint32_t *)entries)[i];
+		acpi_header *header = acpi_map(paddr, sizeof(acpi_header));
+		if (header && !memcmp(header->signature, signature, 4))
+			return acpi_map_table(paddr);
+	}
+	return NULL;
+}
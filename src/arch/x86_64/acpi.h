@@ -0,0 +1,52 @@
+#ifndef _X86_64_ACPI_H
+#define _X86_64_ACPI_H
+
+#include <stdint.h>
+
+#define MADT_LOCAL_APIC 0
+#define MADT_LOCAL_X2APIC 9
+#define MADT_ENABLED (1 << 0)
+#define MADT_ONLINE_CAPABLE (1 << 1)
+
+typedef struct {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed)) acpi_header;
+
+typedef struct {
+	acpi_header header;
+	uint32_t local_apic;
+	uint32_t flags;
+	uint8_t entries[];
+} __attribute__((packed)) acpi_madt;
+
+typedef struct {
+	uint8_t type;
+	uint8_t length;
+} __attribute__((packed)) madt_entry;
+
+typedef struct {
+	madt_entry entry;
+	uint8_t processor;
+	uint8_t apic_id;
+	uint32_t flags;
+} __attribute__((packed)) madt_local_apic;
+
+typedef struct {
+	madt_entry entry;
+	uint16_t reserved;
+	uint32_t apic_id;
+	uint32_t flags;
+	uint32_t processor;
+} __attribute__((packed)) madt_local_x2apic;
+
+acpi_header *acpi_find_table(const char *signature);
+
+#endif //_X86_64_ACPI_H
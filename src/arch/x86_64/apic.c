@@ -0,0 +1,180 @@
+#include <debug.h>
+#include <erikboot.h>
+#include <irq.h>
+#include <memory.h>
+#include <paging.h>
+#include <vmm.h>
+
+#include "apic.h"
+#include "cpu.h"
+
+#define CPUID_1_EDX_APIC (1 << 9)
+#define CPUID_1_ECX_X2APIC (1 << 21)
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_X2APIC (1 << 10)
+#define APIC_BASE_ENABLE (1 << 11)
+#define APIC_BASE_ADDRESS 0x000FFFFFFFFFF000
+
+// In x2APIC mode every register is an MSR at 0x800 plus its offset / 16.
+#define MSR_X2APIC_BASE 0x800
+#define MSR_X2APIC_EOI 0x80B
+#define MSR_X2APIC_ICR 0x830
+#define MSR_X2APIC_SELF_IPI 0x83F
+
+#define APIC_SVR_ENABLE (1 << 8)
+#define APIC_ICR_PENDING (1 << 12)
+#define APIC_ICR_SELF (1 << 18)
+
+#define IRQ_FIRST_VECTOR 32
+#define IRQ_VECTORS 256
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+#define PIC_ICW1_INIT 0x11
+#define PIC_ICW4_8086 0x01
+
+static volatile uint32_t *apic_mmio = NULL;
+static bool x2apic = false;
+
+uint32_t apic_read(uint32_t reg)
+{
+	if (x2apic)
+		return rdmsr(MSR_X2APIC_BASE + (reg >> 4));
+	return apic_mmio[reg / 4];
+}
+
+void apic_write(uint32_t reg, uint32_t value)
+{
+	if (x2apic)
+		wrmsr(MSR_X2APIC_BASE + (reg >> 4), value);
+	else
+		apic_mmio[reg / 4] = value;
+}
+
+bool apic_present(void)
+{
+	return x2apic || apic_mmio;
+}
+
+// The PIC is moved past the exceptions before it is masked, as it may still
+// raise spurious interrupts.
+static void pic_disable(void)
+{
+	outb(PIC1_COMMAND, PIC_ICW1_INIT);
+	outb(PIC2_COMMAND, PIC_ICW1_INIT);
+	outb(PIC1_DATA, IRQ_FIRST_VECTOR);
+	outb(PIC2_DATA, IRQ_FIRST_VECTOR + 8);
+	outb(PIC1_DATA, 1 << 2);
+	outb(PIC2_DATA, 2);
+	outb(PIC1_DATA, PIC_ICW4_8086);
+	outb(PIC2_DATA, PIC_ICW4_8086);
+	outb(PIC1_DATA, 0xFF);
+	outb(PIC2_DATA, 0xFF);
+}
+
+// Enables the local APIC of the calling CPU, in the mode the boot CPU
+// picked. x2APIC mode can only be entered from xAPIC mode.
+void apic_cpu_init(void)
+{
+	uint64_t base = rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE;
+	wrmsr(MSR_APIC_BASE, base);
+	if (x2apic)
+		wrmsr(MSR_APIC_BASE, base | APIC_BASE_X2APIC);
+
+	apic_write(APIC_TPR, 0);
+	apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED);
+	apic_write(APIC_LVT_ERROR, APIC_LVT_MASKED);
+	apic_write(APIC_SVR, apic_read(APIC_SVR) | APIC_SVR_ENABLE |
+				     APIC_SPURIOUS_VECTOR);
+}
+
+void irq_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	pic_disable();
+	if (!(edx & CPUID_1_EDX_APIC)) {
+		DEBUG_PRINTF("apic: no local APIC\n");
+		return;
+	}
+
+	x2apic = ecx & CPUID_1_ECX_X2APIC;
+	if (!x2apic) {
+		uint64_t base = rdmsr(MSR_APIC_BASE);
+		apic_mmio = ioremap(base & APIC_BASE_ADDRESS, PAGE_SIZE,
+				    P_KERNEL_WRITE | P_CACHE_UC);
+		if (!apic_mmio) {
+			DEBUG_PRINTF("apic: could not map registers\n");
+			return;
+		}
+	}
+
+	apic_cpu_init();
+	asm volatile("sti");
+}
+
+uint32_t apic_id(void)
+{
+	if (x2apic)
+		return rdmsr(MSR_X2APIC_BASE + (APIC_ID >> 4));
+	return apic_mmio[APIC_ID / 4] >> 24;
+}
+
+// Sends an interrupt command and waits until the local APIC took it.
+void apic_send_ipi(uint32_t destination, uint32_t command)
+{
+	if (x2apic) {
+		wrmsr(MSR_X2APIC_ICR, (uint64_t)destination << 32 | command);
+		return;
+	}
+
+	apic_write(APIC_ICR_HIGH, destination << 24);
+	apic_write(APIC_ICR_LOW, command);
+	while (apic_read(APIC_ICR_LOW) & APIC_ICR_PENDING)
+		asm volatile("pause");
+}
+
+// Called from the interrupt stubs, which only save the registers a C
+// function may clobber.
+void apic_irq_handler(uint64_t vector)
+{
+	// Spurious interrupts are never in service, so they take no EOI.
+	if (vector == APIC_SPURIOUS_VECTOR)
+		return;
+
+	irq_dispatch(vector);
+	if (x2apic)
+		wrmsr(MSR_X2APIC_EOI, 0);
+	else
+		apic_mmio[APIC_EOI / 4] = 0;
+}
+
+// Vectors are the local APIC's own, there is nothing to mask per vector.
+bool irq_unmask(uint32_t irq)
+{
+	return irq >= IRQ_FIRST_VECTOR && irq < IRQ_VECTORS &&
+	       irq != APIC_SPURIOUS_VECTOR;
+}
+
+void irq_mask(uint32_t irq)
+{
+	(void)irq;
+}
+
+// The priority of a vector is fixed by its number.
+void irq_set_priority(uint32_t irq, uint8_t priority)
+{
+	(void)irq;
+	(void)priority;
+}
+
+void irq_raise(uint32_t irq)
+{
+	if (x2apic)
+		wrmsr(MSR_X2APIC_SELF_IPI, irq);
+	else if (apic_mmio)
+		apic_write(APIC_ICR_LOW, APIC_ICR_SELF | irq);
+}
@@ -0,0 +1,41 @@
+#ifndef _X86_64_APIC_H
+#define _X86_64_APIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define APIC_ID 0x020
+#define APIC_TPR 0x080
+#define APIC_EOI 0x0B0
+#define APIC_SVR 0x0F0
+#define APIC_ICR_LOW 0x300
+#define APIC_ICR_HIGH 0x310
+#define APIC_LVT_TIMER 0x320
+#define APIC_LVT_ERROR 0x370
+#define APIC_TIMER_INITIAL 0x380
+#define APIC_TIMER_CURRENT 0x390
+#define APIC_TIMER_DIVIDE 0x3E0
+
+#define APIC_LVT_MASKED (1 << 16)
+#define APIC_LVT_TSC_DEADLINE (2 << 17)
+#define APIC_TIMER_DIVIDE_1 0xB
+
+#define APIC_ICR_INIT (5 << 8)
+#define APIC_ICR_STARTUP (6 << 8)
+#define APIC_ICR_ASSERT (1 << 14)
+#define APIC_ICR_ALL_BUT_SELF (3 << 18)
+
+// Vectors 32-47 are where the masked legacy PIC was moved to.
+#define APIC_TIMER_VECTOR 0x30
+// Asks the other CPUs to flush their TLBs.
+#define APIC_TLB_VECTOR 0xF0
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+uint32_t apic_read(uint32_t reg);
+void apic_write(uint32_t reg, uint32_t value);
+bool apic_present(void);
+void apic_cpu_init(void);
+uint32_t apic_id(void);
+void apic_send_ipi(uint32_t destination, uint32_t command);
+
+#endif //_X86_64_APIC_H
@@ -1,12 +1,43 @@
 #include <arch.h>
 
-void gdt_init(void);
+#define RFLAGS_IF (1 << 9)
+
 void idt_init(void);
+void smp_cpu_setup(uint32_t id);
 void get_pml4(void);
+void pcid_init(void);
 
 void arch_init(void)
 {
-	gdt_init();
 	idt_init();
+	smp_cpu_setup(0);
 	get_pml4();
+	pcid_init();
+}
+
+uint64_t arch_cycles(void)
+{
+	uint32_t low, high;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
+// The instruction after sti still runs with interrupts off, so a wakeup
+// cannot slip in between enabling them and halting.
+void arch_idle(void)
+{
+	asm volatile("sti; hlt" ::: "memory");
+}
+
+uint64_t arch_irq_save(void)
+{
+	uint64_t flags;
+	asm volatile("pushfq; popq %0; cli" : "=r"(flags)::"memory");
+	return flags;
+}
+
+void arch_irq_restore(uint64_t flags)
+{
+	if (flags & RFLAGS_IF)
+		asm volatile("sti" ::: "memory");
 }
@@ -0,0 +1,40 @@
+#ifndef _X86_64_CPU_H
+#define _X86_64_CPU_H
+
+#include <stdint.h>
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+			 uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+	asm volatile("cpuid"
+		     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+		     : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+	uint32_t low, high;
+	asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+	return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+	asm volatile("wrmsr" ::"c"(msr), "a"((uint32_t)value),
+		     "d"((uint32_t)(value >> 32))
+		     : "memory");
+}
+
+static inline void outb(uint16_t port, uint8_t val)
+{
+	asm volatile("outb %b0, %w1" : : "a"(val), "Nd"(port) : "memory");
+}
+
+static inline uint8_t inb(uint16_t port)
+{
+	uint8_t ret;
+	asm volatile("inb %w1, %b0" : "=a"(ret) : "Nd"(port) : "memory");
+	return ret;
+}
+
+#endif //_X86_64_CPU_H
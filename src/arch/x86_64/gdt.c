@@ -1,4 +1,8 @@
 #include <debug.h>
+#include <smp.h>
+
+#define GDT_ENTRIES 7
+#define GDT_TSS 0x28
 
 typedef struct {
 	uint16_t limit_low;
@@ -15,14 +19,27 @@ typedef struct {
 	uint64_t base;
 } __attribute__((packed)) gdtr;
 
-__attribute__((aligned(0x10))) static segment_descriptor gdt[6];
-static gdtr _gdtr = { .limit = (uint16_t)sizeof(gdt) - 1,
-		      .base = (uintptr_t)gdt };
+typedef struct {
+	uint32_t reserved0;
+	uint64_t rsp[3];
+	uint64_t reserved1;
+	uint64_t ist[7];
+	uint64_t reserved2;
+	uint16_t reserved3;
+	uint16_t iomap_base;
+} __attribute__((packed)) task_state;
+
+// Every CPU has its own GDT, as the busy flag of a TSS descriptor keeps it
+// from being loaded on two of them.
+__attribute__((aligned(0x10))) static segment_descriptor
+	gdt[SMP_MAX_CPUS][GDT_ENTRIES];
+__attribute__((aligned(0x10))) static task_state tss[SMP_MAX_CPUS];
 
-void gdt_set_descriptor(uint8_t selector, uint32_t base, uint32_t limit,
-			uint8_t access, uint8_t flags)
+void gdt_set_descriptor(segment_descriptor *table, uint8_t selector,
+			uint32_t base, uint32_t limit, uint8_t access,
+			uint8_t flags)
 {
-	segment_descriptor *descriptor = &gdt[selector / 8];
+	segment_descriptor *descriptor = &table[selector / 8];
 
 	descriptor->base_low = base & 0xFFFF;
 	descriptor->base_mid = (base >> 16) & 0xFF;
@@ -33,14 +50,32 @@ void gdt_set_descriptor(uint8_t selector, uint32_t base, uint32_t limit,
 	descriptor->flags = flags;
 }
 
-void gdt_init(void)
+// The TSS descriptor takes two slots, the second holds the upper half of
+// the base.
+static void gdt_set_tss(segment_descriptor *table, task_state *task)
 {
-	gdt_set_descriptor(0, 0, 0, 0, 0);
-	gdt_set_descriptor(0x8, 0, 0xFFFFF, 0x9A, 0xA);
-	gdt_set_descriptor(0x10, 0, 0xFFFFF, 0x92, 0xC);
-	gdt_set_descriptor(0x18, 0, 0xFFFFF, 0xFA, 0xA);
-	gdt_set_descriptor(0x20, 0, 0xFFFFF, 0xF2, 0xC);
-	gdt_set_descriptor(0x28, 0, 0, 0, 0);
+	uintptr_t base = (uintptr_t)task;
+	gdt_set_descriptor(table, GDT_TSS, base, sizeof(task_state) - 1, 0x89,
+			   0);
+	*(uint64_t *)&table[GDT_TSS / 8 + 1] = base >> 32;
+}
+
+// Loads the GDT and TSS of the given CPU. stack is where the CPU enters
+// the kernel from user mode.
+void gdt_init(uint32_t cpu_id, uintptr_t stack)
+{
+	segment_descriptor *table = gdt[cpu_id];
+	gdtr _gdtr = { .limit = (uint16_t)sizeof(gdt[0]) - 1,
+		       .base = (uintptr_t)table };
+
+	gdt_set_descriptor(table, 0, 0, 0, 0, 0);
+	gdt_set_descriptor(table, 0x8, 0, 0xFFFFF, 0x9A, 0xA);
+	gdt_set_descriptor(table, 0x10, 0, 0xFFFFF, 0x92, 0xC);
+	gdt_set_descriptor(table, 0x18, 0, 0xFFFFF, 0xFA, 0xA);
+	gdt_set_descriptor(table, 0x20, 0, 0xFFFFF, 0xF2, 0xC);
+	tss[cpu_id].rsp[0] = stack;
+	tss[cpu_id].iomap_base = sizeof(task_state);
+	gdt_set_tss(table, &tss[cpu_id]);
 
 	asm volatile("lgdt %0;"
 		     "pushq $0x8;"
@@ -55,5 +90,7 @@ void gdt_init(void)
 		     "movw %%ax, %%ss;"
 		     "1:"
 		     :
-		     : "m"(_gdtr));
+		     : "m"(_gdtr)
+		     : "rax", "memory");
+	asm volatile("ltr %w0" ::"r"(GDT_TSS));
 }
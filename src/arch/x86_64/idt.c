@@ -1,4 +1,9 @@
 #include <debug.h>
+#include <vmm.h>
+
+#define PF_PRESENT (1 << 0)
+#define PF_WRITE (1 << 1)
+#define PF_USER (1 << 2)
 
 typedef struct {
 	uint16_t isr_low;
@@ -84,12 +89,31 @@ char *register_names[] = {
 	"R9",  "R10", "R11", "R12", "R13", "R14", "R15",
 };
 
+#define IRQ_STUB_SIZE 16
+
 extern void *isr_stub_table[];
+extern char irq_stubs[];
+
+static uint64_t page_fault_flags(uint64_t error_code)
+{
+	uint64_t fault = 0;
+	if (error_code & PF_PRESENT)
+		fault |= VM_FAULT_PROTECTION;
+	if (error_code & PF_WRITE)
+		fault |= VM_FAULT_WRITE;
+	if (error_code & PF_USER)
+		fault |= VM_FAULT_USER;
+	return fault;
+}
 
-void isr_handler(interrupt_frame *frame)
+interrupt_frame *isr_handler(interrupt_frame *frame)
 {
 	uint64_t cr2;
 	asm volatile("movq %%cr2, %0" : "=r"(cr2));
+	if (frame->isr_number == 0xE &&
+	    vmm_handle_fault(cr2, page_fault_flags(frame->error_code)))
+		return frame;
+
 	DEBUG_PRINTF("=== PANIC! ===\n"
 		     " - Unhandled %s @ %#016lX!\n",
 		     exception_names[frame->isr_number], frame->rip);
@@ -99,6 +123,7 @@ void isr_handler(interrupt_frame *frame)
 	if (frame->isr_number == 0xE)
 		DEBUG_PRINTF("Fault address: %#016lX\n", cr2);
 	asm volatile("1: cli; hlt; jmp 1b");
+	return frame;
 }
 
 void idt_set_descriptor(uint8_t vector, void *isr, uint8_t flags)
@@ -118,6 +143,15 @@ void idt_init(void)
 {
 	for (uint8_t vector = 0; vector < 32; vector++)
 		idt_set_descriptor(vector, isr_stub_table[vector], 0x8E);
+	for (unsigned int vector = 32; vector < 256; vector++)
+		idt_set_descriptor(vector,
+				   irq_stubs + (vector - 32) * IRQ_STUB_SIZE,
+				   0x8E);
+}
 
-	asm volatile("lidt %0; sti" : : "m"(_idtr));
+// Every CPU shares the one IDT.
+void idt_load(void)
+{
+	// Interrupts stay off until the interrupt controller is set up.
+	asm volatile("lidt %0" : : "m"(_idtr));
 }
@@ -1,8 +1,20 @@
 #include <debug.h>
 #include <erikboot.h>
+#include <heap.h>
+#include <irq.h>
+#include <lock.h>
 #include <memory.h>
 #include <paging.h>
 
+#include "apic.h"
+#include "cpu.h"
+
+void smp_reserve_trampoline(void);
+
+#if PAGE_SHIFT != 12
+#error "x86_64 only has 4 KiB pages"
+#endif
+
 #define PML4_INDEX(x) (((x) >> 39) & 0x1FF)
 #define PDPT_INDEX(x) (((x) >> 30) & 0x1FF)
 #define PD_INDEX(x) (((x) >> 21) & 0x1FF)
@@ -11,15 +23,174 @@
 #define P_X64_PRESENT (1 << 0)
 #define P_X64_WRITE (1 << 1)
 #define P_X64_USER (1 << 2)
+#define P_X64_PWT (1 << 3)
+#define P_X64_PCD (1 << 4)
+#define P_X64_LARGE (1 << 7)
+#define P_X64_GLOBAL (1 << 8)
+#define P_X64_COW (1 << 9)
+#define P_X64_OWNED (1 << 10)
+
+#define PTE_ADDRESS 0x000FFFFFFFFFF000
+#define LARGE_PAGE_ADDRESS 0x000FFFFFFFE00000
 
 #define TABLE_DEFAULT (P_X64_PRESENT | P_X64_WRITE | P_X64_USER)
 
-uint64_t *tables = NULL;
+#define TABLE(entry) ((uint64_t *)phys_to_virt((entry) & PTE_ADDRESS))
+
+#define CR0_WP (1 << 16)
+#define CR3_NOFLUSH (1ULL << 63)
+#define CR4_PGE (1 << 7)
+#define CR4_PCIDE (1 << 17)
+
+#define CPUID_1_ECX_PCID (1 << 17)
+#define CPUID_7_EBX_INVPCID (1 << 10)
+#define CPUID_80000001_EDX_PDPE1GB (1 << 26)
+
+#define PCID_COUNT 4096
+
+#define INVPCID_SINGLE_CONTEXT 1
+#define INVPCID_ALL_NON_GLOBAL 3
+
+#define PAGING_FREE_BATCH 16
+
+#define MSR_PAT 0x277
+
+// PCD and PWT alone select WB, WT, WC and UC, so the PAT bit, which moves
+// around between levels, is never needed. The upper half mirrors them.
+#define PAT_VALUE 0x0001040600010406ULL
+
+address_space kernel_space = { .regions_lock = RWLOCK_INIT("regions"),
+				.tables_lock = SPINLOCK_INIT("tables") };
+PERCPU address_space *current_space = &kernel_space;
+
+static const int paging_level_shifts[] = { 39, 30, 21, 12 };
+static const size_t paging_level_sizes[] = { 0x8000000000, HUGE_PAGE_SIZE,
+					     LARGE_PAGE_SIZE, PAGE_SIZE };
+
+static bool pcid_enabled = false;
+static bool invpcid_supported = false;
+static uint64_t pcid_generation = 1;
+static uint64_t pcid_next = 1;
+static spinlock pcid_lock = SPINLOCK_INIT("pcid");
+// The last generation this CPU flushed its TLB for.
+static PERCPU uint64_t pcid_flushed = 1;
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uintptr_t vaddr)
+{
+	struct {
+		uint64_t pcid;
+		uint64_t vaddr;
+	} descriptor = { pcid, vaddr };
+	asm volatile("invpcid %0, %1" ::"m"(descriptor), "r"(type) : "memory");
+}
 
 void get_pml4(void)
 {
-	if (!tables)
-		asm volatile("movq %%cr3, %0" : "=r"(tables));
+	if (!kernel_space.tables) {
+		asm volatile("movq %%cr3, %0" : "=r"(kernel_space.tables));
+		kernel_space.tables =
+			(uint64_t *)((uintptr_t)kernel_space.tables & ~0xFFF);
+	}
+}
+
+void pcid_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if (!(ecx & CPUID_1_ECX_PCID))
+		return;
+
+	cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax >= 7) {
+		cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+		invpcid_supported = ebx & CPUID_7_EBX_INVPCID;
+	}
+
+	// CR4.PCIDE can only be set while CR3 selects PCID 0, which is what
+	// the kernel space keeps for its whole lifetime.
+	uint64_t cr4;
+	asm volatile("movq %%cr4, %0" : "=r"(cr4));
+	asm volatile("movq %0, %%cr4" ::"r"(cr4 | CR4_PCIDE) : "memory");
+	pcid_enabled = true;
+}
+
+static void pcid_flush_all(void)
+{
+	if (invpcid_supported) {
+		invpcid(INVPCID_ALL_NON_GLOBAL, 0, 0);
+		return;
+	}
+
+	// Toggling CR4.PGE drops every TLB entry of every PCID.
+	uint64_t cr4;
+	asm volatile("movq %%cr4, %0" : "=r"(cr4));
+	asm volatile("movq %0, %%cr4;"
+		     "movq %1, %%cr4" ::"r"(cr4 ^ CR4_PGE),
+		     "r"(cr4)
+		     : "memory");
+}
+
+// Returns the PCID to load the space with.
+static uint64_t pcid_assign(address_space *space)
+{
+	uint64_t generation = __atomic_load_n(&space->asid_generation,
+					      __ATOMIC_ACQUIRE);
+	uint64_t pcid = space->asid;
+	if (generation != __atomic_load_n(&pcid_generation, __ATOMIC_RELAXED)) {
+		uint64_t flags = spin_lock_irqsave(&pcid_lock);
+		// Once the PCIDs run out, start a new generation. Every space
+		// has to pick up a fresh PCID.
+		if (space->asid_generation != pcid_generation) {
+			if (pcid_next == PCID_COUNT) {
+				pcid_generation++;
+				pcid_next = 1;
+			}
+			space->asid = pcid_next++;
+			space->tlb_flush_pending = false;
+			__atomic_store_n(&space->asid_generation,
+					 pcid_generation, __ATOMIC_RELEASE);
+		}
+		generation = space->asid_generation;
+		pcid = space->asid;
+		spin_unlock_irqrestore(&pcid_lock, flags);
+	}
+
+	// Other CPUs may still hold entries tagged with a PCID from before it
+	// was handed out again. Each of them drops everything the first time
+	// it loads a PCID of the new generation, after which a PCID new to the
+	// generation has no stale entries left anywhere it runs.
+	if (this_cpu_read(pcid_flushed) != generation) {
+		pcid_flush_all();
+		this_cpu_write(pcid_flushed, generation);
+	}
+	return pcid;
+}
+
+void paging_switch(address_space *space)
+{
+	if (space == this_cpu_read(current_space))
+		return;
+
+	uint64_t cr3 = (uintptr_t)space->tables;
+	if (pcid_enabled) {
+		if (space != &kernel_space)
+			cr3 |= pcid_assign(space);
+		if (!space->tlb_flush_pending)
+			cr3 |= CR3_NOFLUSH;
+	}
+	space->tlb_flush_pending = false;
+	this_cpu_write(current_space, space);
+
+	asm volatile("movq %0, %%cr3" ::"r"(cr3) : "memory");
+}
+
+void paging_invalidate(address_space *space, uintptr_t vaddr)
+{
+	// Kernel mappings are global, so INVLPG drops them from every PCID.
+	if (space == &kernel_space || space == this_cpu_read(current_space))
+		asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+	else
+		space->tlb_flush_pending = true;
 }
 
 uint64_t paging_flags_to_arch(uint64_t flags)
@@ -27,79 +198,871 @@ uint64_t paging_flags_to_arch(uint64_t flags)
 	uint64_t arch_flags = P_X64_PRESENT;
 	if (flags & P_USER)
 		arch_flags |= P_X64_USER;
-	if (flags & P_WRITE)
+	if (flags & P_COW)
+		arch_flags |= P_X64_COW;
+	else if (flags & P_WRITE)
 		arch_flags |= P_X64_WRITE;
+	if (flags & P_OWNED)
+		arch_flags |= P_X64_OWNED;
+
+	switch (flags & P_CACHE_MASK) {
+	case P_CACHE_WT:
+		arch_flags |= P_X64_PWT;
+		break;
+	case P_CACHE_WC:
+		arch_flags |= P_X64_PCD;
+		break;
+	case P_CACHE_UC:
+		arch_flags |= P_X64_PCD | P_X64_PWT;
+		break;
+	}
 	return arch_flags;
 }
 
-uint64_t *paging_create_table(void)
+address_space *paging_create_space(void)
 {
-	uintptr_t table = find_free_frames(1);
-	if (!table)
+	address_space *space = malloc(sizeof(address_space));
+	if (!space)
+		return NULL;
+
+	space->tables = paging_create_table();
+	if (!space->tables) {
+		free(space);
+		return NULL;
+	}
+
+	// Share the kernel half. The lower half of the kernel space is left
+	// out, mapping into it would write to the kernel's tables.
+	memcpy((char *)phys_to_virt((uintptr_t)space->tables) + PAGE_SIZE / 2,
+	       (char *)phys_to_virt((uintptr_t)kernel_space.tables) +
+		       PAGE_SIZE / 2,
+	       PAGE_SIZE / 2);
+	space->asid = 0;
+	space->asid_generation = 0;
+	space->tlb_flush_pending = false;
+	space->regions_lock = (rwlock)RWLOCK_INIT("regions");
+	space->regions = NULL;
+	space->tables_lock = (spinlock)SPINLOCK_INIT("tables");
+	paging_walk_cache_flush(space);
+	return space;
+}
+
+static void paging_shootdown(address_space *space, uintptr_t vaddr,
+			     size_t pages);
+
+// Marks an entry as shared by one more table. Writable entries become
+// read-only copy-on-write ones, read-only entries stay as they are. Leaves
+// the space does not own, like device memory, are shared as they are.
+static void paging_share_entry(uint64_t *entry, bool leaf)
+{
+	if (!(*entry & P_X64_PRESENT) || (leaf && !(*entry & P_X64_OWNED)))
+		return;
+	if (*entry & P_X64_WRITE)
+		*entry = (*entry & ~P_X64_WRITE) | P_X64_COW;
+	frame_ref(*entry & PTE_ADDRESS);
+}
+
+address_space *paging_clone_space(address_space *parent)
+{
+	address_space *child = paging_create_space();
+	if (!child)
 		return NULL;
-	set_frame_lock(table, 1, true);
-	memset((char *)table, 0, PAGE_SIZE);
-	return (uint64_t *)table;
+
+	// Only the top level is copied now. The tables below it are shared
+	// read-only and copied one level at a time as writes hit them, so a
+	// clone costs as much as the part of it that is written to.
+	uint64_t irq = spin_lock_irqsave(&parent->tables_lock);
+	uint64_t *from = TABLE((uintptr_t)parent->tables);
+	uint64_t *to = TABLE((uintptr_t)child->tables);
+	for (size_t i = 0; i < 256; ++i) {
+		paging_share_entry(&from[i], false);
+		to[i] = from[i];
+	}
+
+	spin_unlock_irqrestore(&parent->tables_lock, irq);
+
+	// Any CPU running the parent may still have writable translations
+	// cached.
+	paging_shootdown(parent, 0, 0);
+	return child;
 }
 
-void paging_map_page(uint64_t *tables, uintptr_t vaddr, uintptr_t paddr,
-		     uint64_t flags)
+// Drops a space's hold on a table below the top level. Tables still shared
+// with a clone only lose a reference, the others are freed along with the
+// tables under them. Owned leaves drop their reference, which frees the
+// frames nobody else maps.
+static void paging_release_table(uintptr_t table, int level)
 {
-	uint64_t pml4_index = PML4_INDEX(vaddr);
-	uint64_t pdpt_index = PDPT_INDEX(vaddr);
-	uint64_t pd_index = PD_INDEX(vaddr);
-	uint64_t pt_index = PT_INDEX(vaddr);
+	if (frame_refcount(table) > 1) {
+		frame_unref(table);
+		return;
+	}
 
-	uint64_t *pdpt = (uint64_t *)(tables[pml4_index] & ~0xFFF);
-	if (!pdpt || !(tables[pml4_index] & P_X64_PRESENT)) {
-		pdpt = paging_create_table();
-		tables[pml4_index] = (uint64_t)pdpt | TABLE_DEFAULT;
+	size_t size = paging_level_sizes[level];
+	uint64_t *entries = TABLE(table);
+	for (size_t i = 0; i < 512; ++i) {
+		uint64_t entry = entries[i];
+		if (!(entry & P_X64_PRESENT))
+			continue;
+		if (level < 3 && !(entry & P_X64_LARGE))
+			paging_release_table(entry & PTE_ADDRESS, level + 1);
+		else if (entry & P_X64_OWNED)
+			paging_put_frames(entry & PTE_ADDRESS & ~(size - 1),
+					  size);
 	}
+	paging_free_table(table);
+}
+
+// The space must not be loaded on any CPU.
+void paging_destroy_space(address_space *space)
+{
+	uint64_t *top = TABLE((uintptr_t)space->tables);
+	for (size_t i = 0; i < 256; ++i) {
+		if (top[i] & P_X64_PRESENT)
+			paging_release_table(top[i] & PTE_ADDRESS, 1);
+	}
+	paging_free_table((uintptr_t)space->tables);
+	free(space);
+}
 
-	uint64_t *pd = (uint64_t *)(pdpt[pdpt_index] & ~0xFFF);
-	if (!pd || !(pdpt[pdpt_index] & P_X64_PRESENT)) {
-		pd = paging_create_table();
-		pdpt[pdpt_index] = (uint64_t)pd | TABLE_DEFAULT;
+static bool paging_break_cow(uint64_t *entry, int level, bool leaf)
+{
+	size_t size = leaf ? paging_level_sizes[level] : PAGE_SIZE;
+	uint64_t address = PTE_ADDRESS & ~(size - 1);
+	uintptr_t frame = *entry & address;
+	if (frame_refcount(frame) > 1) {
+		intptr_t copy;
+		if (leaf) {
+			copy = find_free_frames_aligned(size / PAGE_SIZE, size);
+			if (copy < 0)
+				return false;
+			memcpy(phys_to_virt(copy), phys_to_virt(frame), size);
+		} else {
+			copy = (intptr_t)paging_create_table();
+			if (!copy)
+				return false;
+
+			// Both copies of the table now point at everything below.
+			uint64_t *old = phys_to_virt(frame);
+			uint64_t *new = phys_to_virt(copy);
+			for (size_t i = 0; i < 512; ++i) {
+				bool leaf = level == 2 ||
+					    (old[i] & P_X64_LARGE);
+				paging_share_entry(&old[i], leaf);
+				new[i] = old[i];
+			}
+			frame_info *from = frame_get_info(frame);
+			frame_info *to = frame_get_info(copy);
+			if (from && to)
+				to->used_entries = from->used_entries;
+		}
+		frame_unref(frame);
+		frame = copy;
 	}
 
-	uint64_t *pt = (uint64_t *)(pd[pd_index] & ~0xFFF);
-	if (!pt || !(pd[pd_index] & P_X64_PRESENT)) {
-		pt = paging_create_table();
-		pd[pd_index] = (uint64_t)pt | TABLE_DEFAULT;
+	// The last owner takes the frame over as it is.
+	*entry = (*entry & ~(address | P_X64_COW)) | frame | P_X64_WRITE;
+	return true;
+}
+
+// Tables under the kernel half are shared by every space, so they go by
+// the kernel space's lock.
+static spinlock *paging_tables_lock(address_space *space, uintptr_t vaddr)
+{
+	return vaddr >= KERNEL_HALF_BASE ? &kernel_space.tables_lock :
+					   &space->tables_lock;
+}
+
+bool paging_resolve_cow(address_space *space, uintptr_t vaddr, bool user)
+{
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	uint64_t *entry = &TABLE((uintptr_t)space->tables)[PML4_INDEX(vaddr)];
+	bool broken = false;
+	bool resolved = false;
+	for (int level = 0; level < 4; ++level) {
+		if (!(*entry & P_X64_PRESENT))
+			break;
+
+		if (user && !(*entry & P_X64_USER))
+			break;
+
+		bool leaf = level == 3 || (level && (*entry & P_X64_LARGE));
+		if (*entry & P_X64_COW) {
+			if (!paging_break_cow(entry, level, leaf))
+				break;
+			broken = true;
+		} else if (!(*entry & P_X64_WRITE)) {
+			break;
+		}
+
+		// Without a copy made here, another CPU made the page
+		// writable and this one only had a stale translation left.
+		if (leaf) {
+			resolved = true;
+			break;
+		}
+		entry = &TABLE(*entry)[(vaddr >> paging_level_shifts[level + 1]) &
+				       0x1FF];
 	}
 
+	// Tables copied on the way down moved entries even if the walk
+	// stopped short of the leaf.
+	if (broken)
+		paging_walk_cache_flush(space);
+	spin_unlock_irqrestore(lock, irq);
+
+	// Other CPUs running the space may still read the old frame.
+	if (broken)
+		paging_shootdown(space, vaddr, 1);
+	else if (resolved)
+		paging_invalidate(space, vaddr);
+	return resolved;
+}
+
+static uint64_t *paging_next_table(address_space *space, uint64_t *entry,
+				   int level)
+{
+	if (*entry & P_X64_PRESENT) {
+		if (*entry & P_X64_LARGE)
+			return NULL;
+
+		// Mapping into a table shared with a clone would show up in
+		// the clone too, so it is made private first.
+		if (*entry & P_X64_COW) {
+			if (!paging_break_cow(entry, level, false))
+				return NULL;
+			paging_walk_cache_flush(space);
+		}
+		return TABLE(*entry);
+	}
+
+	uint64_t *table = paging_create_table();
+	if (!table)
+		return NULL;
+	*entry = (uint64_t)table | TABLE_DEFAULT;
+	paging_account_entry(entry, 1);
+	return TABLE(*entry);
+}
+
+// A hole a large or huge page filled in meanwhile is no error either.
+static int paging_fill_failed(uint64_t entry, uint64_t flags)
+{
+	return (flags & P_FILL) && (entry & P_X64_LARGE) ? 1 : -1;
+}
+
+// Blocks only go where nothing is mapped yet or over another block. Over a
+// table, the tables below would be lost along with everything they map.
+static int paging_block_conflict(uint64_t entry, uint64_t flags)
+{
+	if (!(entry & P_X64_PRESENT))
+		return 0;
+	if (flags & P_FILL)
+		return 1;
+	return entry & P_X64_LARGE ? 0 : -1;
+}
+
+static int paging_map_page_locked(address_space *space, uintptr_t vaddr,
+				  uintptr_t paddr, uint64_t flags)
+{
+	uint64_t *pml4 = TABLE((uintptr_t)space->tables);
+	uint64_t *pdpt = paging_next_table(space, &pml4[PML4_INDEX(vaddr)], 0);
+	if (!pdpt)
+		return -1;
+	uint64_t *pd = paging_next_table(space, &pdpt[PDPT_INDEX(vaddr)], 1);
+	if (!pd)
+		return paging_fill_failed(pdpt[PDPT_INDEX(vaddr)], flags);
+	uint64_t *pt = paging_next_table(space, &pd[PD_INDEX(vaddr)], 2);
+	if (!pt)
+		return paging_fill_failed(pd[PD_INDEX(vaddr)], flags);
+
+	// Kernel mappings are shared by every space, so there is no point in
+	// tagging them with a PCID.
 	uint64_t arch_flags = paging_flags_to_arch(flags);
-	pt[pt_index] = (paddr & ~0xFFF) | arch_flags;
+	if (space == &kernel_space)
+		arch_flags |= P_X64_GLOBAL;
+	if (!(pt[PT_INDEX(vaddr)] & P_X64_PRESENT))
+		paging_account_entry(&pt[PT_INDEX(vaddr)], 1);
+	else if (flags & P_FILL)
+		return 1;
+	if (flags & P_OWNED)
+		frame_ref(paddr & PTE_ADDRESS);
+	pt[PT_INDEX(vaddr)] = (paddr & PTE_ADDRESS) | arch_flags;
+	return 0;
 }
 
-void paging_unmap_page(uint64_t *tables, uintptr_t vaddr)
+static int paging_map_large_page_locked(address_space *space, uintptr_t vaddr,
+					uintptr_t paddr, uint64_t flags)
 {
-	uint64_t pml4_index = PML4_INDEX(vaddr);
-	uint64_t pdpt_index = PDPT_INDEX(vaddr);
-	uint64_t pd_index = PD_INDEX(vaddr);
-	uint64_t pt_index = PT_INDEX(vaddr);
+	uint64_t *pml4 = TABLE((uintptr_t)space->tables);
+	uint64_t *pdpt = paging_next_table(space, &pml4[PML4_INDEX(vaddr)], 0);
+	if (!pdpt)
+		return -1;
+	uint64_t *pd = paging_next_table(space, &pdpt[PDPT_INDEX(vaddr)], 1);
+	if (!pd)
+		return paging_fill_failed(pdpt[PDPT_INDEX(vaddr)], flags);
 
-	if (!(tables[pml4_index] & P_X64_PRESENT))
-		return;
-	uint64_t *pdpt = (uint64_t *)(tables[pml4_index] & ~0xFFF);
+	uint64_t arch_flags = paging_flags_to_arch(flags) | P_X64_LARGE;
+	if (space == &kernel_space)
+		arch_flags |= P_X64_GLOBAL;
+	uint64_t *pde = &pd[PD_INDEX(vaddr)];
+	int conflict = paging_block_conflict(*pde, flags);
+	if (conflict)
+		return conflict;
+	if (!(*pde & P_X64_PRESENT))
+		paging_account_entry(pde, 1);
+	if (flags & P_OWNED)
+		frame_ref(paddr & LARGE_PAGE_ADDRESS);
+	*pde = (paddr & LARGE_PAGE_ADDRESS) | arch_flags;
+	return 0;
+}
+
+static int paging_map_huge_page_locked(address_space *space, uintptr_t vaddr,
+				       uintptr_t paddr, uint64_t flags)
+{
+	uint64_t *pml4 = TABLE((uintptr_t)space->tables);
+	uint64_t *pdpt = paging_next_table(space, &pml4[PML4_INDEX(vaddr)], 0);
 	if (!pdpt)
+		return -1;
+
+	uint64_t arch_flags = paging_flags_to_arch(flags) | P_X64_LARGE;
+	if (space == &kernel_space)
+		arch_flags |= P_X64_GLOBAL;
+	uint64_t *pdpte = &pdpt[PDPT_INDEX(vaddr)];
+	int conflict = paging_block_conflict(*pdpte, flags);
+	if (conflict)
+		return conflict;
+	if (!(*pdpte & P_X64_PRESENT))
+		paging_account_entry(pdpte, 1);
+	if (flags & P_OWNED)
+		frame_ref(paddr & ~(HUGE_PAGE_SIZE - 1));
+	*pdpte = (paddr & ~(HUGE_PAGE_SIZE - 1)) | arch_flags;
+	return 0;
+}
+
+int paging_map_page(address_space *space, uintptr_t vaddr, uintptr_t paddr,
+		    uint64_t flags)
+{
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	int error = paging_map_page_locked(space, vaddr, paddr, flags);
+	spin_unlock_irqrestore(lock, irq);
+	return error;
+}
+
+int paging_map_large_page(address_space *space, uintptr_t vaddr,
+			  uintptr_t paddr, uint64_t flags)
+{
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	int error = paging_map_large_page_locked(space, vaddr, paddr, flags);
+	spin_unlock_irqrestore(lock, irq);
+	return error;
+}
+
+int paging_map_huge_page(address_space *space, uintptr_t vaddr,
+			 uintptr_t paddr, uint64_t flags)
+{
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	int error = paging_map_huge_page_locked(space, vaddr, paddr, flags);
+	spin_unlock_irqrestore(lock, irq);
+	return error;
+}
+
+// Only a hint, the tables may change as soon as it returns. Faults map with
+// P_FILL, which checks again under the lock.
+bool paging_large_page_unmapped(address_space *space, uintptr_t vaddr)
+{
+	uint64_t pml4e = TABLE((uintptr_t)space->tables)[PML4_INDEX(vaddr)];
+	if (!(pml4e & P_X64_PRESENT))
+		return true;
+	uint64_t pdpte = TABLE(pml4e)[PDPT_INDEX(vaddr)];
+	if (!(pdpte & P_X64_PRESENT))
+		return true;
+	if (pdpte & P_X64_LARGE)
+		return false;
+	return !(TABLE(pdpte)[PD_INDEX(vaddr)] & P_X64_PRESENT);
+}
+
+int paging_map_range(address_space *space, uintptr_t vaddr, uintptr_t paddr,
+		     size_t size, uint64_t flags)
+{
+	bool huge = paging_huge_pages_supported();
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	int error = 0;
+	for (size_t done = 0; done < size && !error;) {
+		uintptr_t v = vaddr + done;
+		uintptr_t p = paddr + done;
+		size_t left = size - done;
+
+		if (huge && paging_range_fits(v, p, left, HUGE_PAGE_SIZE)) {
+			error = paging_map_huge_page_locked(space, v, p, flags);
+			done += HUGE_PAGE_SIZE;
+		} else if (paging_range_fits(v, p, left, LARGE_PAGE_SIZE)) {
+			error = paging_map_large_page_locked(space, v, p,
+							     flags);
+			done += LARGE_PAGE_SIZE;
+		} else {
+			error = paging_map_page_locked(space, v, p, flags);
+			done += PAGE_SIZE;
+		}
+	}
+	spin_unlock_irqrestore(lock, irq);
+	return error ? -1 : 0;
+}
+
+bool paging_huge_pages_supported(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+	return edx & CPUID_80000001_EDX_PDPE1GB;
+}
+
+static void paging_flush_global(void)
+{
+	uint64_t cr4;
+	asm volatile("movq %%cr4, %0" : "=r"(cr4));
+	asm volatile("movq %0, %%cr4;"
+		     "movq %1, %%cr4" ::"r"(cr4 & ~CR4_PGE),
+		     "r"(cr4 | CR4_PGE)
+		     : "memory");
+}
+
+// Tables and frames an unmap let go of. They are only freed once no CPU
+// can reach them through its TLB any more. A size of 0 marks a table.
+typedef struct {
+	uintptr_t frames[PAGING_FREE_BATCH];
+	size_t sizes[PAGING_FREE_BATCH];
+	size_t count;
+	bool tables;
+} paging_free_list;
+
+static void paging_defer_free(paging_free_list *list, uintptr_t frame,
+			      size_t size)
+{
+	list->frames[list->count] = frame;
+	list->sizes[list->count++] = size;
+	list->tables |= !size;
+}
+
+// Clears the entry mapping vaddr and queues the frame it owned and the
+// tables that leaves empty. Returns the size of the region the walk stopped
+// at, so callers can step over whatever is not mapped. It queues at most
+// four frames.
+static size_t paging_clear(address_space *space, uintptr_t vaddr,
+			   paging_free_list *freed)
+{
+	uint64_t *path[4];
+	uint64_t *entry = &TABLE((uintptr_t)space->tables)[PML4_INDEX(vaddr)];
+	int level = 0;
+	for (;; ++level) {
+		if (!(*entry & P_X64_PRESENT))
+			return paging_level_sizes[level];
+		if (level == 3 || (level && (*entry & P_X64_LARGE)))
+			break;
+
+		// A table shared with a clone has to be made private first,
+		// which moves the entries the walk caches point at.
+		if (*entry & P_X64_COW) {
+			if (!paging_break_cow(entry, level, false))
+				return paging_level_sizes[level];
+			paging_walk_cache_flush(space);
+		}
+		path[level] = entry;
+		entry = &TABLE(*entry)[(vaddr >> paging_level_shifts[level + 1]) &
+				       0x1FF];
+	}
+
+	uint64_t leaf = *entry;
+	size_t size = paging_level_sizes[level];
+	*entry = 0;
+	paging_account_entry(entry, -1);
+	if (leaf & P_X64_OWNED)
+		paging_defer_free(freed, leaf & PTE_ADDRESS & ~(size - 1),
+				  size);
+
+	// The kernel space's PDPTs stay, as other spaces link to them.
+	for (int i = level - 1; i >= 0; --i) {
+		if (!i && (space == &kernel_space || vaddr >= KERNEL_HALF_BASE))
+			break;
+		uintptr_t table = *path[i] & PTE_ADDRESS;
+		frame_info *info = frame_get_info(table);
+		if (!info || info->used_entries)
+			break;
+		*path[i] = 0;
+		paging_account_entry(path[i], -1);
+		paging_defer_free(freed, table, 0);
+	}
+	return size;
+}
+
+// Entries tagged with a space's PCID outlive switching away from it.
+static void pcid_flush_space(address_space *space)
+{
+	if (!pcid_enabled || !space->asid_generation)
 		return;
+	if (invpcid_supported)
+		invpcid(INVPCID_SINGLE_CONTEXT, space->asid, 0);
+	else
+		pcid_flush_all();
+}
+
+// Drops what this CPU may have cached of the pages, or of the whole space
+// if pages is 0.
+static void paging_flush_local(address_space *space, uintptr_t vaddr,
+			       size_t pages)
+{
+	bool all = !pages || pages > PAGING_FLUSH_THRESHOLD;
+	if (space != &kernel_space && space != this_cpu_read(current_space))
+		pcid_flush_space(space);
+	else if (!all)
+		for (size_t i = 0; i < pages; ++i)
+			paging_invalidate(space, vaddr + i * PAGE_SIZE);
+	else if (space == &kernel_space)
+		paging_flush_global();
+	else
+		asm volatile("movq %0, %%cr3" ::"r"((uintptr_t)space->tables |
+						    space->asid)
+			     : "memory");
+}
 
-	if (!(pdpt[pdpt_index] & P_X64_PRESENT))
+// Other CPUs flush what the request describes and clear their bit, there
+// is one for each of the SMP_MAX_CPUS. Only one request is out at a time.
+static spinlock shootdown_lock = SPINLOCK_INIT("shootdown");
+static address_space *shootdown_space;
+static uintptr_t shootdown_vaddr;
+static size_t shootdown_pages;
+static uint64_t shootdown_cpus;
+
+static void paging_shootdown_serve(void)
+{
+	uint64_t bit = 1ULL << this_cpu()->id;
+	if (!(__atomic_load_n(&shootdown_cpus, __ATOMIC_ACQUIRE) & bit))
 		return;
-	uint64_t *pd = (uint64_t *)(pdpt[pdpt_index] & ~0xFFF);
-	if (!pd)
+	paging_flush_local(shootdown_space, shootdown_vaddr, shootdown_pages);
+	__atomic_and_fetch(&shootdown_cpus, ~bit, __ATOMIC_RELEASE);
+}
+
+static void paging_shootdown_irq(uint32_t irq, void *data)
+{
+	(void)irq;
+	(void)data;
+	paging_shootdown_serve();
+}
+
+// Flushes the pages, or the whole space if pages is 0, on every online CPU
+// and returns once all of them are done. It must not be called with a
+// tables lock held, another CPU may be waiting for it with interrupts off.
+static void paging_shootdown(address_space *space, uintptr_t vaddr,
+			     size_t pages)
+{
+	paging_flush_local(space, vaddr, pages);
+	if (__atomic_load_n(&smp_cpu_count, __ATOMIC_ACQUIRE) < 2)
 		return;
 
-	if (!(pd[pd_index] & P_X64_PRESENT))
+	// Waiting for the lock with interrupts off is fine as long as the
+	// requests of whoever holds it are still served.
+	uint64_t irq = arch_irq_save();
+	while (!spin_trylock(&shootdown_lock)) {
+		paging_shootdown_serve();
+		cpu_relax();
+	}
+	shootdown_space = space;
+	shootdown_vaddr = vaddr;
+	shootdown_pages = pages;
+
+	uint32_t self = this_cpu()->id;
+	for (uint32_t id = 0; id < SMP_MAX_CPUS; ++id) {
+		if (id == self || !__atomic_load_n(&cpus[id].online,
+						   __ATOMIC_ACQUIRE))
+			continue;
+		__atomic_or_fetch(&shootdown_cpus, 1ULL << id,
+				  __ATOMIC_RELEASE);
+		apic_send_ipi(cpus[id].arch_id, APIC_TLB_VECTOR);
+	}
+	while (__atomic_load_n(&shootdown_cpus, __ATOMIC_ACQUIRE))
+		cpu_relax();
+
+	spin_unlock(&shootdown_lock);
+	arch_irq_restore(irq);
+}
+
+// Drops the lock, flushes what was unmapped everywhere and only then frees
+// what the unmap let go of.
+static void paging_finish_unmap(address_space *space, spinlock *lock,
+				uint64_t irq, uintptr_t vaddr, size_t size,
+				paging_free_list *freed)
+{
+	// Freed tables may be walked by any PCID, INVLPG only drops the
+	// cached upper levels of the current one.
+	if (freed->tables) {
+		paging_walk_cache_flush(space);
+		if (space == &kernel_space)
+			size = 0;
+	}
+	spin_unlock_irqrestore(lock, irq);
+
+	paging_shootdown(space, vaddr, size / PAGE_SIZE);
+	for (size_t i = 0; i < freed->count; ++i) {
+		if (freed->sizes[i])
+			paging_put_frames(freed->frames[i], freed->sizes[i]);
+		else
+			paging_free_table(freed->frames[i]);
+	}
+	freed->count = 0;
+	freed->tables = false;
+}
+
+void paging_unmap_page(address_space *space, uintptr_t vaddr)
+{
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	uint64_t irq = spin_lock_irqsave(lock);
+	paging_free_list freed = { .count = 0 };
+	paging_clear(space, vaddr, &freed);
+	paging_finish_unmap(space, lock, irq, vaddr, PAGE_SIZE, &freed);
+}
+
+void paging_unmap_range(address_space *space, uintptr_t vaddr, size_t size)
+{
+	spinlock *lock = paging_tables_lock(space, vaddr);
+	paging_free_list freed = { .count = 0 };
+	uintptr_t end = vaddr + size;
+	uintptr_t page = vaddr;
+	while (page < end) {
+		// Each step queues up to four frames. Once the list is full,
+		// they are flushed and freed before going on.
+		uintptr_t start = page;
+		uint64_t irq = spin_lock_irqsave(lock);
+		while (page < end && freed.count + 4 <= PAGING_FREE_BATCH) {
+			size_t step = paging_clear(space, page, &freed);
+			page = (page & ~(step - 1)) + step;
+		}
+		if (page > end)
+			page = end;
+		paging_finish_unmap(space, lock, irq, start, page - start,
+				    &freed);
+	}
+}
+
+static intptr_t paging_translate_pde(uint64_t pde, uintptr_t vaddr)
+{
+	if (!(pde & P_X64_PRESENT))
+		return -1;
+	if (pde & P_X64_LARGE)
+		return (pde & LARGE_PAGE_ADDRESS) +
+		       (vaddr & (LARGE_PAGE_SIZE - 1));
+
+	uint64_t pte = TABLE(pde)[PT_INDEX(vaddr)];
+	if (!(pte & P_X64_PRESENT))
+		return -1;
+	return (pte & PTE_ADDRESS) + (vaddr & 0xFFF);
+}
+
+intptr_t paging_translate(address_space *space, uintptr_t vaddr)
+{
+	// The kernel half is the same everywhere, so only the kernel space
+	// caches walks through it.
+	if (vaddr >= KERNEL_HALF_BASE)
+		space = &kernel_space;
+
+	// A cached entry only counts if its slot stayed the same while the
+	// walk went on through it, otherwise the walk starts over further up.
+	uint32_t sequence;
+	uintptr_t large_tag = paging_walk_cache_tag(vaddr, LARGE_PAGE_SIZE);
+	uint64_t *pde = paging_walk_cache_lookup(space->large_cache, large_tag,
+						 &sequence);
+	if (pde) {
+		intptr_t paddr = paging_translate_pde(*pde, vaddr);
+		if (paging_walk_cache_unchanged(space->large_cache, large_tag,
+						sequence))
+			return paddr;
+	}
+
+	uintptr_t huge_tag = paging_walk_cache_tag(vaddr, HUGE_PAGE_SIZE);
+	uint64_t *pdpte = paging_walk_cache_lookup(space->huge_cache, huge_tag,
+						   &sequence);
+	uint64_t entry = pdpte ? *pdpte : 0;
+	if (pdpte && !paging_walk_cache_unchanged(space->huge_cache, huge_tag,
+						  sequence))
+		pdpte = NULL;
+	if (!pdpte) {
+		uint64_t *pml4 = TABLE((uintptr_t)space->tables);
+		uint64_t pml4e = pml4[PML4_INDEX(vaddr)];
+		if (!(pml4e & P_X64_PRESENT))
+			return -1;
+		pdpte = &TABLE(pml4e)[PDPT_INDEX(vaddr)];
+		entry = *pdpte;
+		paging_walk_cache_fill(space->huge_cache, huge_tag, pdpte);
+	}
+
+	if (!(entry & P_X64_PRESENT))
+		return -1;
+	if (entry & P_X64_LARGE)
+		return (entry & PTE_ADDRESS & ~(HUGE_PAGE_SIZE - 1)) +
+		       (vaddr & (HUGE_PAGE_SIZE - 1));
+
+	pde = &TABLE(entry)[PD_INDEX(vaddr)];
+	paging_walk_cache_fill(space->large_cache, large_tag, pde);
+	return paging_translate_pde(*pde, vaddr);
+}
+
+static void paging_pat_init(void)
+{
+	wrmsr(MSR_PAT, PAT_VALUE);
+	asm volatile("wbinvd" ::: "memory");
+	paging_flush_global();
+}
+
+// Hands back the frames and the table the bootloader mapped a large page's
+// worth of the image with.
+static void paging_release_boot_mapping(uint64_t pde)
+{
+	if (!(pde & P_X64_PRESENT))
 		return;
-	uint64_t *pt = (uint64_t *)(pd[pd_index] & ~0xFFF);
-	if (!pt)
+	if (pde & P_X64_LARGE) {
+		set_frame_lock(pde & LARGE_PAGE_ADDRESS,
+			       LARGE_PAGE_SIZE / PAGE_SIZE, false);
+		return;
+	}
+
+	uint64_t *pt = TABLE(pde);
+	for (size_t i = 0; i < 512; ++i) {
+		if (pt[i] & P_X64_PRESENT)
+			set_frame_lock(pt[i] & PTE_ADDRESS, 1, false);
+	}
+	paging_free_table(pde & PTE_ADDRESS);
+}
+
+static void paging_remap_kernel(void)
+{
+	extern char _kernel_start, _kernel_data_start, _kernel_end;
+	uintptr_t start = (uintptr_t)&_kernel_start;
+	uintptr_t data_start = (uintptr_t)&_kernel_data_start;
+	uintptr_t end = (uintptr_t)&_kernel_end;
+
+	// The bootloader may have scattered the image over any frames, so move
+	// it somewhere large pages can cover. Without such a spot the kernel
+	// keeps running on its 4 KiB mappings.
+	size_t frames = (end - start) / PAGE_SIZE;
+	intptr_t image = find_free_frames_aligned(frames, LARGE_PAGE_SIZE);
+	if (image < 0)
 		return;
 
-	if (!(pt[pt_index] & P_X64_PRESENT))
+	// The entries being replaced are kept here until no CPU can still
+	// use them, then what they pointed at is freed.
+	intptr_t replaced = find_free_frames(1);
+	if (replaced < 0) {
+		set_frame_lock(image, frames, false);
 		return;
-	pt[pt_index] = 0;
+	}
+	uint64_t *old = phys_to_virt(replaced);
+
+	// Nothing in the image may be written from here until the large pages
+	// are in place, or the write is lost with the old copy.
+	for (uintptr_t page = start; page < end; page += PAGE_SIZE) {
+		intptr_t from = paging_translate(&kernel_space, page);
+		char *to = phys_to_virt(image + page - start);
+		if (from < 0)
+			memset(to, 0, PAGE_SIZE);
+		else
+			memcpy(to, phys_to_virt(from), PAGE_SIZE);
+	}
+
+	size_t count = 0;
+	uint64_t *pml4 = TABLE((uintptr_t)kernel_space.tables);
+	for (uintptr_t page = start; page < end; page += LARGE_PAGE_SIZE) {
+		uint64_t flags = page < data_start ? P_KERNEL_RO :
+						     P_KERNEL_WRITE;
+		uint64_t pml4e = pml4[PML4_INDEX(page)];
+		uint64_t pdpte = 0;
+		if (pml4e & P_X64_PRESENT)
+			pdpte = TABLE(pml4e)[PDPT_INDEX(page)];
+		uint64_t *pde = NULL;
+		if ((pdpte & P_X64_PRESENT) && !(pdpte & P_X64_LARGE))
+			pde = &TABLE(pdpte)[PD_INDEX(page)];
+		if (!pde || !(*pde & P_X64_PRESENT)) {
+			paging_map_large_page(&kernel_space, page,
+					      image + page - start, flags);
+			continue;
+		}
+
+		// Large pages are not mapped over tables, but the kernel runs
+		// off this one, so it is swapped out in a single write.
+		old[count++] = *pde;
+		*pde = (image + page - start) | paging_flags_to_arch(flags) |
+		       P_X64_LARGE | P_X64_GLOBAL;
+	}
+
+	paging_flush_global();
+	for (size_t i = 0; i < count; ++i)
+		paging_release_boot_mapping(old[i]);
+	set_frame_lock(replaced, 1, false);
+}
+
+static void paging_populate_kernel_half(void)
+{
+	// Spaces copy the kernel half of the PML4 when they are created, so
+	// all of its PDPTs have to exist up front for later kernel mappings
+	// to show up everywhere.
+	uint64_t *pml4 = TABLE((uintptr_t)kernel_space.tables);
+	for (size_t i = 256; i < 512; ++i)
+		paging_next_table(&kernel_space, &pml4[i], 0);
+}
+
+// Tables the bootloader built were never counted, so take stock of every
+// table once the kernel's layout is in place.
+static void paging_account_tables(uintptr_t table, int level)
+{
+	uint64_t *entries = phys_to_virt(table);
+	uint16_t used = 0;
+	for (size_t i = 0; i < 512; ++i) {
+		if (!(entries[i] & P_X64_PRESENT))
+			continue;
+		used++;
+		if (level < 3 && !(level && (entries[i] & P_X64_LARGE)))
+			paging_account_tables(entries[i] & PTE_ADDRESS,
+					      level + 1);
+	}
+
+	frame_info *info = frame_get_info(table);
+	if (info)
+		info->used_entries = used;
+	paging_table_frames++;
+}
+
+// Sets up the paging controls every CPU needs before it runs in the kernel
+// space.
+void paging_cpu_init(void)
+{
+	// Copy-on-write depends on kernel writes to read-only pages faulting.
+	uint64_t cr0;
+	asm volatile("movq %%cr0, %0" : "=r"(cr0));
+	asm volatile("movq %0, %%cr0" ::"r"(cr0 | CR0_WP) : "memory");
+
+	if (pcid_enabled) {
+		uint64_t cr4;
+		asm volatile("movq %%cr4, %0" : "=r"(cr4));
+		asm volatile("movq %0, %%cr4" ::"r"(cr4 | CR4_PCIDE)
+			     : "memory");
+	}
+	paging_pat_init();
+}
+
+void paging_init(BootInfo *boot_info)
+{
+	// The application processors start below 1 MiB.
+	smp_reserve_trampoline();
+
+	paging_cpu_init();
+	paging_remap_kernel();
+	paging_populate_kernel_half();
+	physmap_init(boot_info);
+
+	// The other CPUs only start later, by then the vector is in place.
+	irq_register(APIC_TLB_VECTOR, paging_shootdown_irq, NULL);
 
-	asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+	paging_table_frames = 0;
+	paging_account_tables((uintptr_t)kernel_space.tables, 0);
 }
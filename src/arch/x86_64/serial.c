@@ -1,20 +1,10 @@
 #include <serial.h>
 
+#include "cpu.h"
+
 #define COM1 0x3f8
 #define UART_FREQ 115200
 
-static inline void outb(uint16_t port, uint8_t val)
-{
-	asm volatile("outb %b0, %w1" : : "a"(val), "Nd"(port) : "memory");
-}
-
-static inline uint8_t inb(uint16_t port)
-{
-	uint8_t ret;
-	asm volatile("inb %w1, %b0" : "=a"(ret) : "Nd"(port) : "memory");
-	return ret;
-}
-
 typedef struct {
 	uint64_t base_port;
 	uint32_t baudrate;
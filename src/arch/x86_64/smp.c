@@ -0,0 +1,260 @@
+#include <arch.h>
+#include <clock.h>
+#include <debug.h>
+#include <erikboot.h>
+#include <memory.h>
+#include <paging.h>
+#include <percpu.h>
+#include <smp.h>
+#include <timer.h>
+
+#include "acpi.h"
+#include "apic.h"
+#include "cpu.h"
+
+#define MSR_EFER 0xC0000080
+#define MSR_GS_BASE 0xC0000101
+#define EFER_LMA (1 << 10)
+#define CR4_PCIDE (1 << 17)
+
+// Real mode reaches no further than 1 MiB.
+#define TRAMPOLINE_LIMIT 0x100000
+#define TRAMPOLINE_PAGES 2
+
+#define SMP_INIT_DELAY (10 * NSEC_PER_MSEC)
+#define SMP_STARTUP_DELAY (200 * NSEC_PER_USEC)
+#define SMP_ONLINE_TIMEOUT (100 * NSEC_PER_MSEC)
+
+#define CPUID_1_EBX_LOGICAL(x) (((x) >> 16) & 0xFF)
+
+// Matches the data block at the end of trampoline.S.
+typedef struct {
+	uint64_t gdt[3];
+	uint16_t gdt_limit;
+	uint32_t gdt_base;
+	uint32_t far_offset;
+	uint16_t far_selector;
+	uint32_t cr0;
+	uint32_t cr3;
+	uint32_t cr4;
+	uint32_t efer;
+	uint32_t next;
+	uint32_t max;
+	uint32_t reserved;
+	uint64_t stacks;
+	uint64_t kernel_cr3;
+	uint64_t entry;
+} __attribute__((packed)) trampoline_data;
+
+extern char smp_trampoline[], smp_trampoline_data[], smp_trampoline_end[];
+
+void gdt_init(uint32_t cpu_id, uintptr_t stack);
+void idt_load(void);
+void paging_cpu_init(void);
+
+static intptr_t trampoline = -1;
+static uintptr_t smp_stacks[SMP_MAX_CPUS];
+
+// Low memory is the first to be handed out, so it is set aside as soon as
+// the frame allocator is up. The second page holds a copy of the top-level
+// table, as CR3 only takes 32 bits outside long mode.
+void smp_reserve_trampoline(void)
+{
+	trampoline = find_free_frames_below(TRAMPOLINE_PAGES, TRAMPOLINE_LIMIT);
+}
+
+// Loads the descriptor tables of the calling CPU and points GS at its
+// per-CPU data.
+void smp_cpu_setup(uint32_t id)
+{
+	gdt_init(id, smp_stacks[id]);
+	idt_load();
+	wrmsr(MSR_GS_BASE, cpus[id].percpu_offset);
+	smp_cpu_enter(id);
+}
+
+[[noreturn]] static void smp_ap_main(uint32_t id)
+{
+	smp_cpu_setup(id);
+	paging_cpu_init();
+	apic_cpu_init();
+	timer_cpu_init();
+	cpus[id].arch_id = apic_id();
+	smp_cpu_online();
+
+	// As on the boot CPU, page tables come from a reserve filled here.
+	for (;;) {
+		paging_reserve_refill();
+		arch_idle();
+	}
+}
+
+// Sets up the stack and the per-CPU data of a CPU about to be started.
+static bool smp_alloc_cpu(uint32_t id)
+{
+	intptr_t stack = find_free_frames(SMP_STACK_SIZE / PAGE_SIZE);
+	if (stack < 0)
+		return false;
+	if (!percpu_init(id)) {
+		set_frame_lock(stack, SMP_STACK_SIZE / PAGE_SIZE, false);
+		return false;
+	}
+	smp_stacks[id] = (uintptr_t)phys_to_virt(stack) + SMP_STACK_SIZE;
+	return true;
+}
+
+static void smp_free_cpu(uint32_t id)
+{
+	percpu_free(id);
+	if (!smp_stacks[id])
+		return;
+	set_frame_lock(virt_to_phys((void *)smp_stacks[id]) - SMP_STACK_SIZE,
+		       SMP_STACK_SIZE / PAGE_SIZE, false);
+	smp_stacks[id] = 0;
+}
+
+static trampoline_data *smp_trampoline_setup(void)
+{
+	size_t size = smp_trampoline_end - smp_trampoline;
+	char *code = phys_to_virt(trampoline);
+	memcpy(code, smp_trampoline, size);
+
+	// The trampoline keeps running for a few instructions after the
+	// switch to the kernel space, so it needs the same address there.
+	if (paging_translate(&kernel_space, trampoline) != trampoline)
+		paging_map_page(&kernel_space, trampoline, trampoline,
+				P_KERNEL_WRITE);
+	uintptr_t pml4 = trampoline + PAGE_SIZE;
+	memcpy(phys_to_virt(pml4),
+	       phys_to_virt((uintptr_t)kernel_space.tables), PAGE_SIZE);
+
+	trampoline_data *data =
+		(trampoline_data *)(code +
+				    (smp_trampoline_data - smp_trampoline));
+	uint64_t cr0, cr4;
+	asm volatile("movq %%cr0, %0" : "=r"(cr0));
+	asm volatile("movq %%cr4, %0" : "=r"(cr4));
+	data->gdt_base += trampoline;
+	data->far_offset += trampoline;
+	data->cr0 = cr0;
+	data->cr3 = pml4;
+	// PCIDs can only be turned on in long mode.
+	data->cr4 = cr4 & ~CR4_PCIDE;
+	data->efer = rdmsr(MSR_EFER) & ~EFER_LMA;
+	data->stacks = (uintptr_t)smp_stacks;
+	data->kernel_cr3 = (uintptr_t)kernel_space.tables;
+	data->entry = (uintptr_t)smp_ap_main;
+	return data;
+}
+
+static void smp_delay(uint64_t ns)
+{
+	uint64_t end = clock_monotonic_ns() + ns;
+	while (clock_monotonic_ns() < end)
+		asm volatile("pause");
+}
+
+// INIT, then two STARTUP IPIs pointing at the trampoline page.
+static void smp_startup(uint32_t destination, uint32_t shorthand)
+{
+	apic_send_ipi(destination, shorthand | APIC_ICR_INIT | APIC_ICR_ASSERT);
+	smp_delay(SMP_INIT_DELAY);
+	for (int i = 0; i < 2; ++i) {
+		apic_send_ipi(destination, shorthand | APIC_ICR_STARTUP |
+						   (trampoline >> 12));
+		smp_delay(SMP_STARTUP_DELAY);
+	}
+}
+
+// Starts the processors the MADT lists one at a time, each into the CPU
+// slot the trampoline is told about. Returns how many it found. Online
+// capable processors are only there to be hot-added later.
+static uint32_t smp_start_madt(trampoline_data *data)
+{
+	acpi_madt *madt = (acpi_madt *)acpi_find_table("APIC");
+	if (!madt)
+		return 0;
+
+	uint32_t found = 0;
+	uint32_t id = 1;
+	uint8_t *end = (uint8_t *)madt + madt->header.length;
+	for (uint8_t *p = madt->entries; p + sizeof(madt_entry) <= end;
+	     p += ((madt_entry *)p)->length) {
+		madt_entry *entry = (madt_entry *)p;
+		uint32_t apic, flags;
+		if (!entry->length)
+			break;
+		if (entry->type == MADT_LOCAL_APIC) {
+			apic = ((madt_local_apic *)entry)->apic_id;
+			flags = ((madt_local_apic *)entry)->flags;
+		} else if (entry->type == MADT_LOCAL_X2APIC) {
+			apic = ((madt_local_x2apic *)entry)->apic_id;
+			flags = ((madt_local_x2apic *)entry)->flags;
+		} else {
+			continue;
+		}
+		if (!(flags & MADT_ENABLED))
+			continue;
+		found++;
+
+		if (apic == cpus[0].arch_id || id == SMP_MAX_CPUS ||
+		    !smp_alloc_cpu(id))
+			continue;
+		data->next = id;
+		data->max = id + 1;
+		smp_startup(apic, 0);
+
+		// A processor that is only late may still come up on the stack
+		// and per-CPU area it was given, so a slot that timed out keeps
+		// them and is not handed out again.
+		if (!smp_wait_online(&cpus[id], SMP_ONLINE_TIMEOUT)) {
+			DEBUG_PRINTF("smp: APIC %u did not come up\n", apic);
+			data->max = 0;
+		}
+		id++;
+	}
+	return found;
+}
+
+// Without a MADT every other processor is woken at once and each takes
+// the next free slot. CPUID tells how many to wait for.
+static void smp_start_all(trampoline_data *data)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	uint32_t expected = CPUID_1_EBX_LOGICAL(ebx);
+	if (expected > SMP_MAX_CPUS)
+		expected = SMP_MAX_CPUS;
+
+	uint32_t id = 1;
+	while (id < expected && smp_alloc_cpu(id))
+		id++;
+	data->next = 1;
+	data->max = id;
+	smp_startup(0, APIC_ICR_ALL_BUT_SELF);
+	smp_wait_count(id, SMP_ONLINE_TIMEOUT);
+
+	// Slots nobody took are closed before their memory goes away. One
+	// that was taken may still come online late, so it keeps its memory.
+	__atomic_store_n(&data->max, 0, __ATOMIC_SEQ_CST);
+	for (id = __atomic_load_n(&data->next, __ATOMIC_SEQ_CST);
+	     id < SMP_MAX_CPUS; ++id)
+		smp_free_cpu(id);
+}
+
+void smp_init(void)
+{
+	cpus[0].arch_id = apic_present() ? apic_id() : 0;
+	smp_cpu_online();
+	if (!apic_present() || trampoline < 0) {
+		DEBUG_PRINTF("smp: only the boot CPU is usable\n");
+		return;
+	}
+
+	trampoline_data *data = smp_trampoline_setup();
+	uint64_t start = clock_monotonic_ns();
+	if (!smp_start_madt(data))
+		smp_start_all(data);
+	DEBUG_PRINTF("smp: %u CPUs online after %lu us\n", smp_cpu_count,
+		     (clock_monotonic_ns() - start) / NSEC_PER_USEC);
+}
@@ -0,0 +1,104 @@
+#include <clock.h>
+#include <debug.h>
+#include <irq.h>
+#include <timer.h>
+
+#include "apic.h"
+#include "cpu.h"
+#include "tsc.h"
+
+#define CPUID_1_ECX_TSC_DEADLINE (1 << 24)
+#define MSR_TSC_DEADLINE 0x6E0
+
+#define CALIBRATE_MS 10
+
+static uint64_t apic_timer_hz = 0;
+static uint64_t ns_to_apic = 0;
+static bool tsc_deadline = false;
+
+// Runs the local APIC timer down for a while the clock measures.
+static void apic_timer_calibrate(void)
+{
+	apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED);
+	apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_1);
+	apic_write(APIC_TIMER_INITIAL, UINT32_MAX);
+	uint64_t end = clock_monotonic_ns() + CALIBRATE_MS * NSEC_PER_MSEC;
+	while (clock_monotonic_ns() < end)
+		;
+	uint32_t ticks = UINT32_MAX - apic_read(APIC_TIMER_CURRENT);
+	apic_write(APIC_TIMER_INITIAL, 0);
+
+	apic_timer_hz = (uint64_t)ticks * 1000 / CALIBRATE_MS;
+	ns_to_apic = clock_mult(NSEC_PER_SEC, apic_timer_hz);
+	DEBUG_PRINTF("clock: APIC timer at %lu kHz\n", apic_timer_hz / 1000);
+}
+
+static void apic_timer_handler(uint32_t irq, void *data)
+{
+	(void)irq;
+	(void)data;
+	timer_interrupt();
+}
+
+bool clockevent_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if (!apic_present() || !tsc_hz)
+		return false;
+	tsc_deadline = ecx & CPUID_1_ECX_TSC_DEADLINE;
+	if (!tsc_deadline)
+		apic_timer_calibrate();
+	if (!tsc_deadline && !apic_timer_hz)
+		return false;
+	if (irq_register(APIC_TIMER_VECTOR, apic_timer_handler, NULL) < 0)
+		return false;
+
+	DEBUG_PRINTF("clock: %s clock events\n",
+		     tsc_deadline ? "TSC deadline" : "APIC one-shot");
+	return clockevent_cpu_init();
+}
+
+// The timers of all CPUs tick at the rate the boot CPU measured.
+bool clockevent_cpu_init(void)
+{
+	// The deadline MSR must not be written before the mode switch is seen.
+	if (tsc_deadline) {
+		apic_write(APIC_LVT_TIMER,
+			   APIC_LVT_TSC_DEADLINE | APIC_TIMER_VECTOR);
+		asm volatile("mfence" ::: "memory");
+	} else {
+		apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_1);
+		apic_write(APIC_LVT_TIMER, APIC_TIMER_VECTOR);
+	}
+	return true;
+}
+
+// A deadline in the past fires at once. Without TSC-deadline mode a wait
+// longer than the 32-bit count only gets part of the way, and the
+// interrupt then finds nothing due and programs the rest.
+void clockevent_program(uint64_t expires)
+{
+	if (expires == CLOCKEVENT_OFF) {
+		if (tsc_deadline)
+			wrmsr(MSR_TSC_DEADLINE, 0);
+		else
+			apic_write(APIC_TIMER_INITIAL, 0);
+		return;
+	}
+
+	if (tsc_deadline) {
+		wrmsr(MSR_TSC_DEADLINE, tsc_from_ns(expires));
+		return;
+	}
+
+	uint64_t now = clock_monotonic_ns();
+	uint64_t count = 0;
+	if (expires > now)
+		count = clock_convert(expires - now, ns_to_apic);
+	if (count == 0)
+		count = 1;
+	if (count > UINT32_MAX)
+		count = UINT32_MAX;
+	apic_write(APIC_TIMER_INITIAL, count);
+}
@@ -0,0 +1,97 @@
+#include <arch.h>
+#include <clock.h>
+#include <debug.h>
+
+#include "cpu.h"
+#include "tsc.h"
+
+#define CPUID_LEAF_TSC 0x15
+#define CPUID_LEAF_FREQUENCY 0x16
+#define CPUID_LEAF_POWER 0x80000007
+#define CPUID_POWER_EDX_INVARIANT_TSC (1 << 8)
+
+#define PIT_FREQUENCY 1193182
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_GATE 0x61
+#define PIT_GATE_ENABLE (1 << 0)
+#define PIT_SPEAKER (1 << 1)
+#define PIT_OUT2 (1 << 5)
+// Channel 2, low then high byte, interrupt on terminal count.
+#define PIT_CHANNEL2_ONESHOT 0xB0
+
+#define CALIBRATE_MS 10
+
+uint64_t tsc_hz = 0;
+static uint64_t tsc_base = 0;
+static uint64_t tsc_to_ns = 0;
+static uint64_t ns_to_tsc = 0;
+
+// Newer CPUs state the TSC rate as a ratio to their crystal clock. Some
+// leave the crystal out, their base frequency is close enough then.
+static uint64_t tsc_cpuid_hz(void)
+{
+	uint32_t max, eax, ebx, ecx, edx;
+	cpuid(0, 0, &max, &ebx, &ecx, &edx);
+	if (max < CPUID_LEAF_TSC)
+		return 0;
+
+	cpuid(CPUID_LEAF_TSC, 0, &eax, &ebx, &ecx, &edx);
+	if (!eax || !ebx)
+		return 0;
+	if (ecx)
+		return (uint64_t)ecx * ebx / eax;
+
+	if (max < CPUID_LEAF_FREQUENCY)
+		return 0;
+	cpuid(CPUID_LEAF_FREQUENCY, 0, &eax, &ebx, &ecx, &edx);
+	return (uint64_t)(eax & 0xFFFF) * 1000000;
+}
+
+// Lets PIT channel 2 count down a known interval, with the speaker off, and
+// sees how far the TSC got meanwhile.
+static uint64_t tsc_pit_hz(void)
+{
+	uint16_t count = PIT_FREQUENCY * CALIBRATE_MS / 1000;
+	uint8_t gate = inb(PIT_GATE);
+	outb(PIT_GATE, (gate & ~PIT_SPEAKER) | PIT_GATE_ENABLE);
+	outb(PIT_COMMAND, PIT_CHANNEL2_ONESHOT);
+	outb(PIT_CHANNEL2, count & 0xFF);
+	outb(PIT_CHANNEL2, count >> 8);
+
+	uint64_t start = arch_cycles();
+	while (!(inb(PIT_GATE) & PIT_OUT2))
+		;
+	uint64_t cycles = arch_cycles() - start;
+	outb(PIT_GATE, gate);
+	return cycles * 1000 / CALIBRATE_MS;
+}
+
+void clock_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(CPUID_LEAF_POWER, 0, &eax, &ebx, &ecx, &edx);
+	if (!(edx & CPUID_POWER_EDX_INVARIANT_TSC))
+		DEBUG_PRINTF("clock: TSC is not invariant\n");
+
+	[[maybe_unused]] const char *source = "CPUID";
+	tsc_hz = tsc_cpuid_hz();
+	if (!tsc_hz) {
+		source = "PIT";
+		tsc_hz = tsc_pit_hz();
+	}
+	tsc_to_ns = clock_mult(tsc_hz, NSEC_PER_SEC);
+	ns_to_tsc = clock_mult(NSEC_PER_SEC, tsc_hz);
+	tsc_base = arch_cycles();
+	DEBUG_PRINTF("clock: TSC at %lu kHz from %s\n", tsc_hz / 1000, source);
+}
+
+uint64_t clock_monotonic_ns(void)
+{
+	return clock_convert(arch_cycles() - tsc_base, tsc_to_ns);
+}
+
+uint64_t tsc_from_ns(uint64_t ns)
+{
+	return tsc_base + clock_convert(ns, ns_to_tsc);
+}
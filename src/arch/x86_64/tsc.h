@@ -0,0 +1,11 @@
+#ifndef _X86_64_TSC_H
+#define _X86_64_TSC_H
+
+#include <stdint.h>
+
+extern uint64_t tsc_hz;
+
+// The TSC value at which clock_monotonic_ns() reaches ns.
+uint64_t tsc_from_ns(uint64_t ns);
+
+#endif //_X86_64_TSC_H
@@ -0,0 +1,359 @@
+#include <arch.h>
+#include <bench.h>
+#include <clock.h>
+#include <debug.h>
+#include <erikboot.h>
+#include <heap.h>
+#include <irq.h>
+#include <memory.h>
+#include <paging.h>
+#include <timer.h>
+#include <vmm.h>
+
+#define BENCH_VADDR 0x8000000000
+#define BENCH_ROUNDS 10000
+#define BENCH_LAZY_VADDR 0xffffd00000000000
+#define BENCH_LAZY_PAGES 256
+#define BENCH_CHURN_PAGES 1024
+#define BENCH_REACH_VADDR 0xffffd80000000000
+#define BENCH_REACH_SIZE 0x1000000
+#define BENCH_REACH_STRIDE 4096
+#define BENCH_HEAP_OBJECTS 2048
+#define BENCH_HEAP_OBJECT_SIZE 1024
+#define BENCH_IRQ 0x40
+#define BENCH_IRQ_TIMEOUT (1 << 24)
+#define BENCH_TIMERS 64
+#define BENCH_TIMER_STEP (50 * NSEC_PER_USEC)
+#define BENCH_TIMEOUTS 200000
+#define BENCH_TIMEOUT_SPREAD (1000 * NSEC_PER_SEC)
+
+// The report is all that uses the arguments, and it goes away without
+// DEBUG_PRINTK.
+static void bench_report([[maybe_unused]] const char *name,
+			 [[maybe_unused]] uint64_t cycles,
+			 [[maybe_unused]] uint64_t n)
+{
+	DEBUG_PRINTF("bench: %-28s %8lu cycles/op\n", name, cycles / n);
+}
+
+static uint64_t bench_ping_pong(address_space *a, address_space *b,
+				bool flush)
+{
+	volatile uint64_t *page = (volatile uint64_t *)BENCH_VADDR;
+	uint64_t start = arch_cycles();
+	for (int i = 0; i < BENCH_ROUNDS; ++i) {
+		a->tlb_flush_pending = flush;
+		paging_switch(a);
+		(void)*page;
+		b->tlb_flush_pending = flush;
+		paging_switch(b);
+		(void)*page;
+	}
+	uint64_t cycles = arch_cycles() - start;
+	paging_switch(&kernel_space);
+	return cycles;
+}
+
+static void bench_address_space_switch(void)
+{
+	address_space *a = paging_create_space();
+	address_space *b = paging_create_space();
+	if (!a || !b)
+		return;
+
+	intptr_t frames = find_free_frames(2);
+	if (frames < 0)
+		return;
+	paging_map_page(a, BENCH_VADDR, frames, P_KERNEL_WRITE);
+	paging_map_page(b, BENCH_VADDR, frames + PAGE_SIZE, P_KERNEL_WRITE);
+
+	bench_report("address space ping-pong",
+		     bench_ping_pong(a, b, false), 2 * BENCH_ROUNDS);
+	bench_report("address space ping-pong+flush",
+		     bench_ping_pong(a, b, true), 2 * BENCH_ROUNDS);
+}
+
+static void bench_translate(void)
+{
+	extern char _kernel_start;
+	uintptr_t base = (uintptr_t)&_kernel_start;
+
+	// Every lookup lands in the same 2 MiB region, so all but the first
+	// one are served by the walk cache.
+	volatile intptr_t paddr;
+	uint64_t start = arch_cycles();
+	for (int i = 0; i < BENCH_ROUNDS; ++i)
+		paddr = paging_translate(&kernel_space,
+					 base + (i % 512) * PAGE_SIZE);
+	bench_report("paging_translate", arch_cycles() - start, BENCH_ROUNDS);
+	(void)paddr;
+}
+
+static void bench_demand_paging(void)
+{
+	static vm_region region = { .start = BENCH_LAZY_VADDR,
+				    .end = BENCH_LAZY_VADDR +
+					   BENCH_LAZY_PAGES * PAGE_SIZE,
+				    .flags = P_KERNEL_WRITE };
+	vmm_add_region(&kernel_space, &region);
+
+	uint64_t faults = this_cpu_read(vmm_fault_count);
+	uint64_t handler_cycles = this_cpu_read(vmm_fault_cycles);
+	uint64_t start = arch_cycles();
+	for (int i = 0; i < BENCH_LAZY_PAGES; ++i)
+		*(volatile uint8_t *)(BENCH_LAZY_VADDR + i * PAGE_SIZE) = 1;
+	uint64_t cycles = arch_cycles() - start;
+
+	faults = this_cpu_read(vmm_fault_count) - faults;
+	DEBUG_PRINTF("bench: %lu demand faults, %lu faults since boot\n",
+		     faults, this_cpu_read(vmm_fault_count));
+	bench_report("first touch", cycles, BENCH_LAZY_PAGES);
+	bench_report("fault handler",
+		     this_cpu_read(vmm_fault_cycles) - handler_cycles,
+		     faults ? faults : 1);
+}
+
+static void bench_table_reclaim(void)
+{
+	address_space *space = paging_create_space();
+	if (!space)
+		return;
+	intptr_t frame = find_free_frames(1);
+	if (frame < 0)
+		return;
+
+	// Every round builds two page tables and leaves them empty again.
+	uint64_t tables = paging_table_frames;
+	uint64_t start = arch_cycles();
+	for (int round = 0; round < 16; ++round) {
+		for (int i = 0; i < BENCH_CHURN_PAGES; ++i)
+			paging_map_page(space, BENCH_VADDR + i * PAGE_SIZE, frame,
+					P_KERNEL_WRITE);
+		paging_unmap_range(space, BENCH_VADDR,
+				   BENCH_CHURN_PAGES * PAGE_SIZE);
+	}
+	bench_report("map+unmap", arch_cycles() - start,
+		     16 * BENCH_CHURN_PAGES);
+	DEBUG_PRINTF("bench: %lu table frames in use, %ld leaked by churn\n",
+		     paging_table_frames, paging_table_frames - tables);
+}
+
+// A page faulted in by a clone must not show up in the parent, although
+// the two share their tables until one of them maps something.
+static void bench_clone(void)
+{
+	address_space *parent = paging_create_space();
+	vm_region *region = malloc(sizeof(vm_region));
+	if (!parent || !region) {
+		free(region);
+		return;
+	}
+	memset(region, 0, sizeof(vm_region));
+	region->start = BENCH_VADDR;
+	region->end = BENCH_VADDR + 2 * PAGE_SIZE;
+	region->flags = P_KERNEL_WRITE;
+	if (vmm_add_region(parent, region) < 0) {
+		free(region);
+		vmm_destroy_space(parent);
+		return;
+	}
+
+	paging_switch(parent);
+	*(volatile uint8_t *)BENCH_VADDR = 1;
+	address_space *child = vmm_clone_space(parent);
+	if (child) {
+		paging_switch(child);
+		uint64_t start = arch_cycles();
+		*(volatile uint8_t *)(BENCH_VADDR + PAGE_SIZE) = 1;
+		bench_report("fault after clone", arch_cycles() - start, 1);
+		DEBUG_PRINTF("bench: clone fault %s the parent\n",
+			     paging_translate(parent, BENCH_VADDR + PAGE_SIZE) <
+					     0 ?
+				     "stayed out of" :
+				     "LEAKED INTO");
+	}
+	paging_switch(&kernel_space);
+	if (child)
+		vmm_destroy_space(child);
+	vmm_destroy_space(parent);
+}
+
+// Compares granules: the buffer is touched every 4 KiB whatever the page
+// size, so bigger pages take fewer faults and fewer TLB entries.
+static void bench_tlb_reach(void)
+{
+	static vm_region region = { .start = BENCH_REACH_VADDR,
+				    .end = BENCH_REACH_VADDR + BENCH_REACH_SIZE,
+				    .flags = P_KERNEL_WRITE };
+	vmm_add_region(&kernel_space, &region);
+	const uint64_t accesses = BENCH_REACH_SIZE / BENCH_REACH_STRIDE;
+
+	uint64_t faults = this_cpu_read(vmm_fault_count);
+	uint64_t start = arch_cycles();
+	for (uintptr_t offset = 0; offset < BENCH_REACH_SIZE;
+	     offset += BENCH_REACH_STRIDE)
+		*(volatile uint8_t *)(BENCH_REACH_VADDR + offset) = 1;
+	uint64_t cycles = arch_cycles() - start;
+	DEBUG_PRINTF("bench: %i KiB pages, %lu faults to back %lu KiB\n",
+		     PAGE_SIZE / 1024, this_cpu_read(vmm_fault_count) - faults,
+		     (uint64_t)BENCH_REACH_SIZE / 1024);
+	bench_report("first touch per 4 KiB", cycles, accesses);
+
+	start = arch_cycles();
+	for (int round = 0; round < 16; ++round)
+		for (uintptr_t offset = 0; offset < BENCH_REACH_SIZE;
+		     offset += BENCH_REACH_STRIDE)
+			(void)*(volatile uint8_t *)(BENCH_REACH_VADDR + offset);
+	bench_report("strided read", arch_cycles() - start, 16 * accesses);
+}
+
+// Spreads objects over a few megabytes of heap and reads them back, which
+// is what large pages behind the heap are meant to speed up.
+static void bench_heap(void)
+{
+	static uint8_t *objects[BENCH_HEAP_OBJECTS];
+	uint64_t faults = this_cpu_read(vmm_fault_count);
+	uint64_t large_faults = this_cpu_read(vmm_large_fault_count);
+
+	uint64_t start = arch_cycles();
+	for (int i = 0; i < BENCH_HEAP_OBJECTS; ++i) {
+		objects[i] = malloc(BENCH_HEAP_OBJECT_SIZE);
+		if (!objects[i])
+			return;
+		objects[i][0] = 1;
+	}
+	bench_report("malloc+touch", arch_cycles() - start,
+		     BENCH_HEAP_OBJECTS);
+	DEBUG_PRINTF("bench: heap took %lu faults, %lu of them large\n",
+		     this_cpu_read(vmm_fault_count) - faults,
+		     this_cpu_read(vmm_large_fault_count) - large_faults);
+
+	start = arch_cycles();
+	for (int round = 0; round < 16; ++round)
+		for (int i = 0; i < BENCH_HEAP_OBJECTS; ++i)
+			(void)*(volatile uint8_t *)objects[i];
+	bench_report("heap object read", arch_cycles() - start,
+		     16 * BENCH_HEAP_OBJECTS);
+
+	for (int i = 0; i < BENCH_HEAP_OBJECTS; ++i)
+		free(objects[i]);
+}
+
+static volatile uint64_t bench_irq_hits = 0;
+
+static void bench_irq_handler(uint32_t irq, void *data)
+{
+	(void)irq;
+	(void)data;
+	bench_irq_hits++;
+}
+
+// Raises an interrupt on this CPU and waits for it, which covers the whole
+// entry, dispatch and EOI path.
+static void bench_irq(void)
+{
+	if (irq_register(BENCH_IRQ, bench_irq_handler, NULL) < 0)
+		return;
+
+	uint64_t start = arch_cycles();
+	for (int i = 0; i < BENCH_ROUNDS; ++i) {
+		uint64_t hits = bench_irq_hits;
+		irq_raise(BENCH_IRQ);
+		for (int spin = 0; bench_irq_hits == hits; ++spin) {
+			if (spin == BENCH_IRQ_TIMEOUT) {
+				DEBUG_PRINTF("bench: no interrupt\n");
+				irq_unregister(BENCH_IRQ);
+				return;
+			}
+		}
+	}
+	bench_report("self interrupt", arch_cycles() - start, BENCH_ROUNDS);
+	irq_unregister(BENCH_IRQ);
+}
+
+static volatile uint64_t bench_timer_hits = 0;
+
+static void bench_timer_callback(timer *t)
+{
+	(void)t;
+	bench_timer_hits++;
+}
+
+// Arms one-shot timers a short way apart and reports how late they ran.
+// Jitter is the spread between the earliest and the latest callback.
+static void bench_timer(void)
+{
+	static timer timers[BENCH_TIMERS];
+
+	timer_stats_reset();
+	bench_timer_hits = 0;
+	uint64_t interrupts = this_cpu_read(timer_interrupt_count);
+	uint64_t now = clock_monotonic_ns();
+	for (int i = 0; i < BENCH_TIMERS; ++i) {
+		timers[i].callback = bench_timer_callback;
+		if (timer_add(&timers[i], now + (i + 1) * BENCH_TIMER_STEP) < 0)
+			return;
+	}
+
+	uint64_t deadline = now + (BENCH_TIMERS + 10) * BENCH_TIMER_STEP;
+	while (bench_timer_hits < BENCH_TIMERS) {
+		if (clock_monotonic_ns() > deadline) {
+			DEBUG_PRINTF("bench: timers did not fire\n");
+			for (int i = 0; i < BENCH_TIMERS; ++i)
+				timer_cancel(&timers[i]);
+			return;
+		}
+	}
+
+	timer_latency *stats = this_cpu_ptr(timer_stats);
+	DEBUG_PRINTF("bench: timer latency %lu/%lu/%lu ns min/avg/max, "
+		     "jitter %lu ns, %lu interrupts\n",
+		     stats->min, stats->total / stats->count, stats->max,
+		     stats->max - stats->min,
+		     this_cpu_read(timer_interrupt_count) - interrupts);
+}
+
+// Arms a large number of far-off coarse timeouts, checks that timer
+// latency does not suffer from them, then cancels them all again.
+static void bench_timeouts(void)
+{
+	timer *timeouts = malloc(BENCH_TIMEOUTS * sizeof(timer));
+	if (!timeouts)
+		return;
+	memset(timeouts, 0, BENCH_TIMEOUTS * sizeof(timer));
+
+	uint64_t now = clock_monotonic_ns();
+	uint64_t start = arch_cycles();
+	for (int i = 0; i < BENCH_TIMEOUTS; ++i) {
+		timeouts[i].callback = bench_timer_callback;
+		uint64_t delay = NSEC_PER_SEC + BENCH_TIMEOUT_SPREAD /
+							BENCH_TIMEOUTS * i;
+		if (timer_add_coarse(&timeouts[i], now + delay) < 0) {
+			free(timeouts);
+			return;
+		}
+	}
+	bench_report("timeout add", arch_cycles() - start, BENCH_TIMEOUTS);
+
+	bench_timer();
+
+	start = arch_cycles();
+	for (int i = 0; i < BENCH_TIMEOUTS; ++i)
+		timer_cancel(&timeouts[i]);
+	bench_report("timeout cancel", arch_cycles() - start, BENCH_TIMEOUTS);
+	free(timeouts);
+}
+
+void bench_run(void)
+{
+	bench_address_space_switch();
+	bench_translate();
+	bench_demand_paging();
+	bench_table_reclaim();
+	bench_clone();
+	bench_tlb_reach();
+	bench_heap();
+	bench_irq();
+	bench_timer();
+	bench_timeouts();
+}
@@ -1,8 +1,19 @@
 #include <debug.h>
 #include <erikboot.h>
+#include <lock.h>
 #include <memory.h>
 #include <stdarg.h>
 
+// The kernel is built without the FP registers where it can be, as
+// interrupts do not save them. Floating point formats only exist where
+// the compiler was still allowed to use them.
+#if defined(__SSE2__) || defined(__ARM_FP)
+#define DEBUG_FLOAT
+#endif
+
+// Keeps the lines of different CPUs from running into each other.
+static spinlock print_lock = SPINLOCK_INIT("print");
+
 void putchar(char c)
 {
 	if (c == '\n')
@@ -62,6 +73,7 @@ void print_int(unsigned long value, int base, int sign, int capital,
 			putchar(leadingZeros ? '0' : ' ');
 }
 
+#ifdef DEBUG_FLOAT
 void print_float(double value, int base, int capital, int emode, int padding,
 		 int precision, int leadingZeros, int alwaysPoint)
 {
@@ -109,6 +121,7 @@ void print_float(double value, int base, int capital, int emode, int padding,
 		print_int(expo, base, 1, capital, 0, 2, 0, 1, 0, 1, 0);
 	}
 }
+#endif
 
 void print_string(char *value, int precision, int padding, int leftJustified)
 {
@@ -157,6 +170,7 @@ void printf(const char *restrict format, ...)
 {
 	va_list args;
 	va_start(args, format);
+	uint64_t flags = spin_lock_irqsave(&print_lock);
 	int escaped = 0;
 
 	for (; *format; format++)
@@ -280,6 +294,7 @@ void printf(const char *restrict format, ...)
 					  minSize, precision, leftJustified,
 					  plusSigned, spaceSigned, leadingZeros,
 					  0);
+#ifdef DEBUG_FLOAT
 			else if (*format == 'f' || *format == 'F')
 				print_float(va_arg(args, double), 10, 0, 0,
 					    minSize, precision, leadingZeros,
@@ -308,6 +323,7 @@ void printf(const char *restrict format, ...)
 				print_float(va_arg(args, double), 10, 1, 0,
 					    minSize, precision, leadingZeros,
 					    1);
+#endif
 			else if (*format == 'p') {
 				DEBUG_PRINT("0x");
 				print_int((uintptr_t)va_arg(args, void *), 16, 0,
@@ -322,5 +338,6 @@ void printf(const char *restrict format, ...)
 		else
 			putchar(*format);
 
+	spin_unlock_irqrestore(&print_lock, flags);
 	va_end(args);
 }
@@ -4,11 +4,15 @@
 #include <fs.h>
 #include <heap.h>
 #include <memory.h>
+#include <paging.h>
+#include <vmm.h>
 
 static int ramfs_find_node(void *data, fs_node *node, const char *path);
 static int ramfs_read(void *data, char *out, size_t cursor, size_t n);
 static void *ramfs_mkdir(void *data, const char *path);
 static void *ramfs_mkfile(void *data, const char *path);
+static intptr_t ramfs_mmap(void *data, address_space *space, uintptr_t vaddr,
+			   uint64_t flags);
 
 typedef struct ramfs_node ramfs_node;
 struct ramfs_node {
@@ -29,6 +33,7 @@ struct ramfs_file {
 fs_mount_point *fs_mounts = NULL;
 fs_driver ramfs_driver = {
 	NULL, ramfs_find_node, ramfs_read, ramfs_mkdir, ramfs_mkfile,
+	ramfs_mmap,
 };
 
 fs_mount_point *fs_mount_point_for_path(const char *path, size_t *index)
@@ -82,9 +87,9 @@ static int oct2bin(char *str, int size)
 
 static void load_initrd(BootInfo *boot_info)
 {
-	char *i_ptr = boot_info->InitrdBase;
-	while ((size_t)(i_ptr - boot_info->InitrdBase) <
-	       boot_info->InitrdSize) {
+	char *initrd = phys_to_virt((uintptr_t)boot_info->InitrdBase);
+	char *i_ptr = initrd;
+	while ((size_t)(i_ptr - initrd) < boot_info->InitrdSize) {
 		if (memcmp(i_ptr + 257, "ustar", 5) != 0)
 			break;
 		size_t filesize = oct2bin(i_ptr + 0x7c, 11);
@@ -212,6 +217,35 @@ static int ramfs_read(void *data, char *out, size_t cursor, size_t n)
 	return 0;
 }
 
+static intptr_t ramfs_mmap(void *data, address_space *space, uintptr_t vaddr,
+			   uint64_t flags)
+{
+	if (!data || (vaddr & (PAGE_SIZE - 1)))
+		return -1;
+	ramfs_node *ramnode = data;
+
+	if (ramnode->type != FILE)
+		return -1;
+
+	ramfs_file *file = (ramfs_file *)ramnode;
+	if (!file->length)
+		return -1;
+
+	// Tar only aligns file data to 512 bytes, so the pages around it are
+	// mapped and the caller is told where in them the file starts.
+	uintptr_t paddr = virt_to_phys(file->data);
+	uintptr_t offset = paddr & (PAGE_SIZE - 1);
+	size_t size = (offset + file->length + PAGE_SIZE - 1) &
+		      ~(PAGE_SIZE - 1);
+
+	// Writes must never reach the initrd itself.
+	if (flags & P_WRITE)
+		flags |= P_COW;
+	if (vmm_map_physical(space, vaddr, paddr - offset, size, flags) < 0)
+		return -1;
+	return vaddr + offset;
+}
+
 static void *ramfs_mkdir(void *data, const char *path)
 {
 	ramfs_node *dir = malloc(sizeof(ramfs_node));
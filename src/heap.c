@@ -1,32 +1,37 @@
 #include <debug.h>
 #include <erikboot.h>
 #include <heap.h>
+#include <lock.h>
 #include <memory.h>
 #include <paging.h>
+#include <vmm.h>
+
+#define HEAP_BASE 0xffffc00000000000
+#define HEAP_SIZE 0x1000000000
+
+// The heap grows 2 MiB at a time. Large pages back it only where they are
+// no bigger than that, with 16 KiB and 64 KiB granules a single one would
+// take 32 MiB or 512 MiB on first touch.
+#define HEAP_CHUNK 0x200000
+#define HEAP_LARGE_PAGES (LARGE_PAGE_SIZE <= HEAP_CHUNK)
 
 uintptr_t heap_start = 0;
 uintptr_t heap_end = 0;
 heap_block *first_block = NULL;
 heap_block *last_block = NULL;
 
-extern char _kernel_end;
+// Every CPU allocates from the one block list, so waiters queue on an MCS
+// lock rather than all spinning on the same word.
+static mcs_lock heap_lock = MCS_LOCK_INIT("heap");
 
-void heap_calculate_virtual_start(BootInfo *boot_info)
-{
-	if (boot_info->InitrdBase)
-		heap_start = (((uintptr_t)boot_info->InitrdBase +
-			       boot_info->InitrdSize) &
-			      ~0xFFF) +
-			     0x1000;
-	else if (boot_info->FBBase)
-		heap_start =
-			(((uintptr_t)boot_info->FBBase + boot_info->FBSize) &
-			 ~0xFFF) +
-			0x1000;
-	else
-		heap_start = ((uintptr_t)&_kernel_end & ~0xFFF) + 0x1000;
-	heap_end = heap_start + 0x1000;
-}
+// The heap is backed on first touch by the page-fault handler, so growing
+// it only moves heap_end. With 4 KiB pages it grows a large page at a
+// time, which the handler backs with a single large page where memory
+// allows.
+static vm_region heap_region = { .start = HEAP_BASE,
+				 .end = HEAP_BASE + HEAP_SIZE,
+				 .flags = P_KERNEL_WRITE,
+				 .large = HEAP_LARGE_PAGES };
 
 void heap_split_block(heap_block *first, size_t size)
 {
@@ -58,17 +63,16 @@ void heap_merge_blocks(heap_block *first, heap_block *second)
 		last_block = first;
 }
 
-bool expand_heap(void)
+bool expand_heap(size_t size)
 {
-	uintptr_t page = find_free_frames(1);
-	if (!page)
+	size_t length = (size + sizeof(heap_block) + HEAP_CHUNK - 1) &
+			~(size_t)(HEAP_CHUNK - 1);
+	if (heap_end + length > heap_region.end)
 		return false;
 
-	set_frame_lock(page, 1, true);
-	paging_map_page(tables, heap_end, page, P_KERNEL_WRITE);
 	heap_block *block = (heap_block *)heap_end;
-	heap_end += PAGE_SIZE;
-	block->size = PAGE_SIZE - sizeof(heap_block);
+	heap_end += length;
+	block->size = length - sizeof(heap_block);
 	block->previous = last_block;
 	block->next = NULL;
 	block->used = false;
@@ -84,18 +88,13 @@ bool expand_heap(void)
 
 void heap_init(BootInfo *boot_info)
 {
-	heap_calculate_virtual_start(boot_info);
-	if (!heap_start)
-		return;
-
-	uintptr_t first_page = find_free_frames(1);
-	if (!first_page)
-		return;
+	(void)boot_info;
+	vmm_add_region(&kernel_space, &heap_region);
 
-	set_frame_lock(first_page, 1, true);
-	paging_map_page(tables, heap_start, first_page, P_KERNEL_WRITE);
+	heap_start = HEAP_BASE;
+	heap_end = heap_start + HEAP_CHUNK;
 	last_block = first_block = (heap_block *)heap_start;
-	first_block->size = PAGE_SIZE - sizeof(heap_block);
+	first_block->size = HEAP_CHUNK - sizeof(heap_block);
 	first_block->previous = NULL;
 	first_block->next = NULL;
 	first_block->used = false;
@@ -118,22 +117,26 @@ heap_block *do_malloc(size_t size)
 
 void *malloc(size_t size)
 {
+	mcs_node node;
 	heap_block *i = NULL;
-	while (true) {
-		if ((i = do_malloc(size)))
-			return (uint8_t *)i + sizeof(heap_block);
-		if (!expand_heap())
-			return NULL;
-	}
+	uint64_t flags = mcs_acquire_irqsave(&heap_lock, &node);
+	while (!(i = do_malloc(size)))
+		if (!expand_heap(size))
+			break;
+	mcs_release_irqrestore(&heap_lock, &node, flags);
+	return i ? (uint8_t *)i + sizeof(heap_block) : NULL;
 }
 
 void free(void *ptr)
 {
+	mcs_node node;
 	heap_block *i = (heap_block *)((uintptr_t)ptr - sizeof(heap_block));
+	uint64_t flags = mcs_acquire_irqsave(&heap_lock, &node);
 	i->used = false;
 
 	if (i->next && !i->next->used)
 		heap_merge_blocks(i, i->next);
 	if (i->previous && !i->previous->used)
 		heap_merge_blocks(i->previous, i);
+	mcs_release_irqrestore(&heap_lock, &node, flags);
 }
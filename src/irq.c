@@ -0,0 +1,42 @@
+#include <irq.h>
+#include <stddef.h>
+
+typedef struct {
+	irq_handler handler;
+	void *data;
+} irq_action;
+
+PERCPU uint64_t irq_unhandled_count = 0;
+
+static irq_action irq_actions[IRQ_COUNT];
+
+int irq_register(uint32_t irq, irq_handler handler, void *data)
+{
+	if (irq >= IRQ_COUNT || irq_actions[irq].handler)
+		return -1;
+
+	irq_actions[irq].data = data;
+	irq_actions[irq].handler = handler;
+	if (!irq_unmask(irq)) {
+		irq_actions[irq].handler = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void irq_unregister(uint32_t irq)
+{
+	if (irq >= IRQ_COUNT)
+		return;
+	irq_mask(irq);
+	irq_actions[irq].handler = NULL;
+}
+
+void irq_dispatch(uint32_t irq)
+{
+	irq_action *action = &irq_actions[irq];
+	if (action->handler)
+		action->handler(irq, action->data);
+	else
+		this_cpu_inc(irq_unhandled_count);
+}
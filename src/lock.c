@@ -0,0 +1,35 @@
+#include <debug.h>
+#include <lock.h>
+
+static lock_stats *lock_stats_list = NULL;
+
+void lock_stats_record(lock_stats *stats, uint64_t start)
+{
+	stats->acquired++;
+	if (start) {
+		stats->contended++;
+		stats->wait_cycles += arch_cycles() - start;
+	}
+	if (stats->listed)
+		return;
+
+	// Other locks may be listed at the same time on other CPUs.
+	stats->listed = true;
+	stats->next = __atomic_load_n(&lock_stats_list, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&lock_stats_list, &stats->next,
+					    stats, true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+// The counters are read without the locks, so the numbers of a busy lock
+// may be off by a few.
+void lock_stats_dump(void)
+{
+	lock_stats *stats = __atomic_load_n(&lock_stats_list, __ATOMIC_ACQUIRE);
+	for (; stats; stats = stats->next)
+		DEBUG_PRINTF("lock: %-16s %lu taken, %lu contended, %lu cycles "
+			     "waiting\n",
+			     stats->name, stats->acquired, stats->contended,
+			     stats->wait_cycles);
+}
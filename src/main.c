@@ -1,22 +1,50 @@
 #include <arch.h>
+#include <bench.h>
+#include <clock.h>
 #include <debug.h>
 #include <erikboot.h>
 #include <fs.h>
 #include <heap.h>
+#include <irq.h>
+#include <lock.h>
 #include <memory.h>
 #include <paging.h>
+#include <percpu.h>
+#include <smp.h>
+#include <timer.h>
+#include <vmm.h>
 
 [[noreturn]] void kernel_main(BootInfo boot_info)
 {
 	DEBUG_INIT();
 	DEBUG_PRINTF("Hello world from ErikKernel!\n\n");
 
+	percpu_init(0);
 	arch_init();
 	page_frame_allocator_init(&boot_info);
+	paging_init(&boot_info);
 	heap_init(&boot_info);
+	irq_init();
+	clock_init();
+	timer_init();
+	smp_init();
+
+	// The framebuffer is only ever written, so let the writes combine.
+	void *fb = NULL;
+	if (boot_info.FBBase)
+		fb = ioremap((uintptr_t)boot_info.FBBase, boot_info.FBSize,
+			     P_KERNEL_WRITE | P_CACHE_WC);
+	if (fb)
+		boot_info.FBBase = fb;
 	fs_init(&boot_info);
 	DEBUG_PRINTF("OK!\n");
+	BENCH_RUN();
+	LOCK_STATS_DUMP();
 
-	for (;;)
-		(void)boot_info;
+	// Page-table frames are set aside here rather than while mapping. The
+	// CPU then sleeps until the next interrupt, there is no periodic tick.
+	for (;;) {
+		paging_reserve_refill();
+		arch_idle();
+	}
 }
@@ -1,11 +1,24 @@
 #include <erikboot.h>
 #include <memory.h>
 #include <debug.h>
+#include <lock.h>
+#include <paging.h>
 
+#define EFI_RESERVED_MEMORY_TYPE 0
 #define EFI_CONVENTIONAL_MEMORY 7
+#define EFI_MEMORY_MAPPED_IO 11
+#define EFI_MEMORY_MAPPED_IO_PORT_SPACE 12
 
 memory _memory = { 0 };
 
+// Guards the bitmap and the frame metadata. The page fault handler
+// allocates, so interrupts stay off while it is held.
+static spinlock frame_lock = SPINLOCK_INIT("frame");
+
+// Until the direct map is built the bootloader's identity map stands in for
+// it.
+uintptr_t physmap_offset = 0;
+
 void *memset(void *destination, int c, size_t num)
 {
 	for (size_t i = 0; i < num; i++)
@@ -120,6 +133,11 @@ void fill_bitmap_region(uint8_t *bitmap, unsigned int start_bit,
 	}
 }
 
+static uintptr_t page_align_up(uintptr_t address)
+{
+	return (address + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+}
+
 void memory_get_size(BootInfo *boot_info)
 {
 	_memory.base = UINTPTR_MAX;
@@ -130,73 +148,244 @@ void memory_get_size(BootInfo *boot_info)
 
 	MMapEntry *memory_map = boot_info->MMapBase;
 	for (size_t i = 0; i < boot_info->MMapEntryCount; i++) {
-		if (memory_map->Type == EFI_CONVENTIONAL_MEMORY &&
-		    _memory.bitmap == 0)
-			_memory.bitmap = (uint8_t *)memory_map->PhysicalStart;
-		if (memory_map->PhysicalStart < _memory.base)
-			_memory.base = memory_map->PhysicalStart;
-		if ((memory_map->PhysicalStart +
-		     memory_map->NumberOfPages * PAGE_SIZE) > _memory.length)
-			_memory.length = memory_map->PhysicalStart +
-					 memory_map->NumberOfPages * PAGE_SIZE;
+		uintptr_t start = memory_map->PhysicalStart;
+		uintptr_t end = start + memory_map->NumberOfPages *
+						EFI_PAGE_SIZE;
+		if (start < _memory.base)
+			_memory.base = start;
+		if (end > _memory.length)
+			_memory.length = end;
 		memory_map = (MMapEntry *)((uintptr_t)memory_map +
 					   boot_info->MMapEntrySize);
 	}
 
-	_memory.length -= _memory.base;
+	// Frames are counted from a page boundary even when the firmware's
+	// 4 KiB pages do not line up with the kernel's.
+	_memory.base &= ~(uintptr_t)(PAGE_SIZE - 1);
+	_memory.length = page_align_up(_memory.length) - _memory.base;
 }
 
-intptr_t find_free_frames(size_t n)
+static void frame_bitmap_fill(uintptr_t frame, size_t n, bool used)
+{
+	fill_bitmap_region(phys_to_virt((uintptr_t)_memory.bitmap),
+			   (frame - _memory.base) / PAGE_SIZE, n, used);
+}
+
+static intptr_t scan_free_frames(size_t n, size_t align, uintptr_t limit)
 {
+	uint8_t *bitmap = phys_to_virt((uintptr_t)_memory.bitmap);
+	size_t align_frames = align / PAGE_SIZE;
 	size_t count = 0;
-	for (size_t i = _memory.base / PAGE_SIZE;
-	     i < _memory.length / PAGE_SIZE; i++) {
-		size_t byte_index = (i - _memory.base / PAGE_SIZE) / 8;
-		size_t bit_index = i % 8;
+	size_t first = _memory.base / PAGE_SIZE;
+	size_t frames = _memory.length / PAGE_SIZE;
+	if (limit <= _memory.base)
+		return -1;
+	if (limit - _memory.base < _memory.length)
+		frames = (limit - _memory.base) / PAGE_SIZE;
+
+	// The bitmap is indexed from the first frame, not from frame 0.
+	for (size_t i = 0; i < frames; i++) {
+		if (!count && (first + i) % align_frames)
+			continue;
 
-		if (!(_memory.bitmap[byte_index] & (1 << bit_index)))
+		if (!(bitmap[i / 8] & (1 << (i % 8))))
 			count++;
 		else
 			count = 0;
 
 		if (count == n)
-			return (i - n + 1) * PAGE_SIZE;
+			return (first + i - n + 1) * PAGE_SIZE;
 	}
 	return -1;
 }
 
+// The frames found are marked as used before the lock is dropped, so no two
+// callers are ever handed the same ones.
+static intptr_t find_free_frames_in(size_t n, size_t align, uintptr_t limit)
+{
+	uint64_t flags = spin_lock_irqsave(&frame_lock);
+	intptr_t frame = scan_free_frames(n, align, limit);
+	if (frame >= 0)
+		frame_bitmap_fill(frame, n, true);
+	spin_unlock_irqrestore(&frame_lock, flags);
+	return frame;
+}
+
+intptr_t find_free_frames_aligned(size_t n, size_t align)
+{
+	return find_free_frames_in(n, align, UINTPTR_MAX);
+}
+
+// For memory that hardware can only reach below some address.
+intptr_t find_free_frames_below(size_t n, uintptr_t limit)
+{
+	return find_free_frames_in(n, PAGE_SIZE, limit);
+}
+
+intptr_t find_free_frames(size_t n)
+{
+	return find_free_frames_aligned(n, PAGE_SIZE);
+}
+
 intptr_t set_frame_lock(uintptr_t frame, size_t n, bool lock)
 {
 	if (frame < _memory.base || frame > _memory.base + _memory.length)
 		return -1;
-	fill_bitmap_region(_memory.bitmap, (frame - _memory.base) / PAGE_SIZE,
-			   n, lock);
+	uint64_t flags = spin_lock_irqsave(&frame_lock);
+	frame_bitmap_fill(frame, n, lock);
+	spin_unlock_irqrestore(&frame_lock, flags);
 	return frame;
 }
 
+// Returns the first free region that can hold size bytes. Low memory tends
+// to come in small pieces, so that is not necessarily the first free one.
+static intptr_t memory_find_region(BootInfo *boot_info, size_t size)
+{
+	MMapEntry *memory_map = boot_info->MMapBase;
+	for (size_t i = 0; i < boot_info->MMapEntryCount; i++) {
+		uintptr_t start = page_align_up(memory_map->PhysicalStart);
+		uintptr_t end = (memory_map->PhysicalStart +
+				 memory_map->NumberOfPages * EFI_PAGE_SIZE) &
+				~(uintptr_t)(PAGE_SIZE - 1);
+		if (memory_map->Type == EFI_CONVENTIONAL_MEMORY &&
+		    end > start && end - start >= size)
+			return start;
+
+		memory_map = (MMapEntry *)((uintptr_t)memory_map +
+					   boot_info->MMapEntrySize);
+	}
+	return -1;
+}
+
 void page_frame_allocator_init(BootInfo *boot_info)
 {
 	memory_get_size(boot_info);
 
-	if (_memory.bitmap == 0) {
-		DEBUG_PRINTF("Could not initialize pfa!\n");
+	// The bitmap comes first and the frame metadata right after it, which
+	// takes 32 times the room of the bitmap.
+	size_t frame_count = _memory.length / PAGE_SIZE;
+	size_t bitmap_length = ((frame_count + 7) / 8 + 7) & ~(size_t)7;
+	size_t info_length = frame_count * sizeof(frame_info);
+	size_t metadata_length = page_align_up(bitmap_length + info_length);
+	intptr_t metadata = memory_find_region(boot_info, metadata_length);
+	if (metadata < 0) {
+		DEBUG_PRINTF("memory: no room for %lu bytes of frame "
+			     "metadata\n",
+			     metadata_length);
 		for (;;)
 			;
 	}
 
-	size_t bitmap_length = _memory.length / PAGE_SIZE / 8;
-	memset(_memory.bitmap, 0xFF, bitmap_length);
+	_memory.bitmap = (uint8_t *)metadata;
+	memset(phys_to_virt((uintptr_t)_memory.bitmap), 0xFF, bitmap_length);
+
+	MMapEntry *memory_map = boot_info->MMapBase;
+	for (size_t i = 0; i < boot_info->MMapEntryCount; i++) {
+		// Only frames lying wholly inside free memory are handed out.
+		uintptr_t start = page_align_up(memory_map->PhysicalStart);
+		uintptr_t end = (memory_map->PhysicalStart +
+				 memory_map->NumberOfPages * EFI_PAGE_SIZE) &
+				~(uintptr_t)(PAGE_SIZE - 1);
+		if (memory_map->Type == EFI_CONVENTIONAL_MEMORY && end > start)
+			set_frame_lock(start, (end - start) / PAGE_SIZE, false);
+
+		memory_map = (MMapEntry *)((uintptr_t)memory_map +
+					   boot_info->MMapEntrySize);
+	}
+
+	_memory.frames = (frame_info *)(metadata + bitmap_length);
+	memset(phys_to_virt((uintptr_t)_memory.frames), 0, info_length);
+
+	set_frame_lock(metadata, metadata_length / PAGE_SIZE, true);
+}
+
+frame_info *frame_get_info(uintptr_t frame)
+{
+	if (frame < _memory.base || frame >= _memory.base + _memory.length)
+		return NULL;
+	frame_info *frames = phys_to_virt((uintptr_t)_memory.frames);
+	return &frames[(frame - _memory.base) / PAGE_SIZE];
+}
+
+// A freshly allocated frame has a single owner, which is what a count of 0
+// stands for, so only shared frames ever need their count maintained.
+// Frames outside of RAM are never counted.
+uint16_t frame_refcount(uintptr_t frame)
+{
+	frame_info *info = frame_get_info(frame);
+	return info && info->refcount ? info->refcount : 1;
+}
+
+void frame_ref(uintptr_t frame)
+{
+	frame_info *info = frame_get_info(frame);
+	if (!info)
+		return;
+	uint64_t flags = spin_lock_irqsave(&frame_lock);
+	info->refcount = frame_refcount(frame) + 1;
+	spin_unlock_irqrestore(&frame_lock, flags);
+}
+
+// Drops one owner and frees the frame along with the last one.
+uint16_t frame_unref(uintptr_t frame)
+{
+	frame_info *info = frame_get_info(frame);
+	if (!info)
+		return 0;
+	uint64_t flags = spin_lock_irqsave(&frame_lock);
+	uint16_t refcount = frame_refcount(frame) - 1;
+	info->refcount = refcount;
+	if (!refcount)
+		frame_bitmap_fill(frame, 1, false);
+	spin_unlock_irqrestore(&frame_lock, flags);
+	return refcount;
+}
+
+static bool physmap_is_ram(uint32_t type)
+{
+	return type != EFI_RESERVED_MEMORY_TYPE &&
+	       type != EFI_MEMORY_MAPPED_IO &&
+	       type != EFI_MEMORY_MAPPED_IO_PORT_SPACE;
+}
 
+static void memory_map_run(uintptr_t offset, uintptr_t start, uintptr_t end)
+{
+	start &= ~(uintptr_t)(PAGE_SIZE - 1);
+	end = page_align_up(end);
+	if (paging_map_range(&kernel_space, offset + start, start, end - start,
+			     P_KERNEL_WRITE) < 0)
+		DEBUG_PRINTF("memory: could not map up to %#016lX\n", end);
+}
+
+// Maps all of RAM into the kernel space, offset bytes above where it lives.
+void memory_map_ram(BootInfo *boot_info, uintptr_t offset)
+{
+	uintptr_t run_start = 0;
+	uintptr_t run_end = 0;
+
+	// Adjacent RAM entries are merged into one run first, so the run can
+	// be covered with the largest pages that fit.
 	MMapEntry *memory_map = boot_info->MMapBase;
 	for (size_t i = 0; i < boot_info->MMapEntryCount; i++) {
-		if (memory_map->Type == EFI_CONVENTIONAL_MEMORY)
-			set_frame_lock(memory_map->PhysicalStart,
-				       memory_map->NumberOfPages, false);
+		if (physmap_is_ram(memory_map->Type)) {
+			uintptr_t start = memory_map->PhysicalStart;
+			uintptr_t end = start + memory_map->NumberOfPages *
+							EFI_PAGE_SIZE;
+			if (start != run_end) {
+				memory_map_run(offset, run_start, run_end);
+				run_start = start;
+			}
+			run_end = end;
+		}
 
 		memory_map = (MMapEntry *)((uintptr_t)memory_map +
 					   boot_info->MMapEntrySize);
 	}
+	memory_map_run(offset, run_start, run_end);
+}
 
-	set_frame_lock((uintptr_t)_memory.bitmap, bitmap_length / PAGE_SIZE + 1,
-		       true);
+void physmap_init(BootInfo *boot_info)
+{
+	memory_map_ram(boot_info, PHYSMAP_BASE);
+	physmap_offset = PHYSMAP_BASE;
 }
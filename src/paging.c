@@ -0,0 +1,85 @@
+#include <arch.h>
+#include <debug.h>
+#include <erikboot.h>
+#include <memory.h>
+#include <paging.h>
+
+#define PAGING_RESERVE_SIZE 16
+
+uint64_t paging_table_frames = 0;
+
+// Zeroed frames set aside for new tables, so mapping a page does not have to
+// scan the allocator. Every CPU keeps its own and tops it up when idle. Only
+// a fault handler can get in the way of the owner, so keeping interrupts
+// off is all the locking needed.
+typedef struct {
+	uintptr_t frames[PAGING_RESERVE_SIZE];
+	size_t count;
+} paging_reserve;
+
+static PERCPU paging_reserve paging_reserve_cpu = { 0 };
+
+static uintptr_t paging_reserve_take(void)
+{
+	uintptr_t table = 0;
+	uint64_t flags = arch_irq_save();
+	paging_reserve *reserve = this_cpu_ptr(paging_reserve_cpu);
+	if (reserve->count)
+		table = reserve->frames[--reserve->count];
+	arch_irq_restore(flags);
+	return table;
+}
+
+// Returns false if the reserve is already full.
+static bool paging_reserve_put(uintptr_t table)
+{
+	uint64_t flags = arch_irq_save();
+	paging_reserve *reserve = this_cpu_ptr(paging_reserve_cpu);
+	bool full = reserve->count == PAGING_RESERVE_SIZE;
+	if (!full)
+		reserve->frames[reserve->count++] = table;
+	arch_irq_restore(flags);
+	return !full;
+}
+
+void paging_reserve_refill(void)
+{
+	while (this_cpu_read(paging_reserve_cpu.count) < PAGING_RESERVE_SIZE) {
+		intptr_t frame = find_free_frames(1);
+		if (frame < 0)
+			return;
+		memset(phys_to_virt(frame), 0, PAGE_SIZE);
+		if (!paging_reserve_put(frame)) {
+			set_frame_lock(frame, 1, false);
+			return;
+		}
+	}
+}
+
+uint64_t *paging_create_table(void)
+{
+	// Only a reserve that ran dry between two top-ups takes the slow path.
+	uintptr_t table = paging_reserve_take();
+	if (!table) {
+		paging_reserve_refill();
+		table = paging_reserve_take();
+	}
+	if (!table) {
+		DEBUG_PRINTF("paging: out of memory for page tables\n");
+		return NULL;
+	}
+
+	frame_info *info = frame_get_info(table);
+	if (info)
+		info->used_entries = 0;
+	__atomic_fetch_add(&paging_table_frames, 1, __ATOMIC_RELAXED);
+	return (uint64_t *)table;
+}
+
+void paging_free_table(uintptr_t table)
+{
+	__atomic_fetch_sub(&paging_table_frames, 1, __ATOMIC_RELAXED);
+	memset(phys_to_virt(table), 0, PAGE_SIZE);
+	if (!paging_reserve_put(table))
+		set_frame_lock(table, 1, false);
+}
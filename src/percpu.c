@@ -0,0 +1,39 @@
+#include <erikboot.h>
+#include <memory.h>
+#include <percpu.h>
+
+#define PERCPU_FRAMES(size) (((size) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+extern char _percpu_start[], _percpu_end[], _percpu_boot[];
+
+PERCPU uintptr_t percpu_self = 0;
+
+// Gives the CPU its copy of the template. The boot CPU comes first, before
+// the frame allocator is up, and takes the space the linker script set
+// aside for it.
+bool percpu_init(uint32_t id)
+{
+	size_t size = _percpu_end - _percpu_start;
+	char *area = _percpu_boot;
+	if (id) {
+		intptr_t frames = find_free_frames(PERCPU_FRAMES(size));
+		if (frames < 0)
+			return false;
+		area = phys_to_virt(frames);
+	}
+
+	memcpy(area, _percpu_start, size);
+	cpus[id].percpu_offset = (uintptr_t)area - (uintptr_t)_percpu_start;
+	*percpu_ptr(percpu_self, id) = cpus[id].percpu_offset;
+	return true;
+}
+
+void percpu_free(uint32_t id)
+{
+	size_t size = _percpu_end - _percpu_start;
+	if (!id || !cpus[id].percpu_offset)
+		return;
+	uintptr_t area = (uintptr_t)_percpu_start + cpus[id].percpu_offset;
+	set_frame_lock(virt_to_phys((void *)area), PERCPU_FRAMES(size), false);
+	cpus[id].percpu_offset = 0;
+}
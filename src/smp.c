@@ -0,0 +1,47 @@
+#include <clock.h>
+#include <percpu.h>
+#include <smp.h>
+#include <stddef.h>
+
+cpu cpus[SMP_MAX_CPUS];
+uint32_t smp_cpu_count = 0;
+
+static PERCPU cpu *cpu_self = NULL;
+
+cpu *this_cpu(void)
+{
+	return this_cpu_read(cpu_self);
+}
+
+// Called by every CPU once its per-CPU register is loaded.
+void smp_cpu_enter(uint32_t id)
+{
+	cpus[id].id = id;
+	this_cpu_write(cpu_self, &cpus[id]);
+}
+
+// Called by every CPU, the boot CPU included, once it is ready for work.
+void smp_cpu_online(void)
+{
+	cpu *self = this_cpu();
+	__atomic_add_fetch(&smp_cpu_count, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->online, true, __ATOMIC_RELEASE);
+}
+
+bool smp_wait_online(cpu *c, uint64_t timeout)
+{
+	uint64_t deadline = clock_monotonic_ns() + timeout;
+	while (!__atomic_load_n(&c->online, __ATOMIC_ACQUIRE))
+		if (clock_monotonic_ns() > deadline)
+			return false;
+	return true;
+}
+
+bool smp_wait_count(uint32_t count, uint64_t timeout)
+{
+	uint64_t deadline = clock_monotonic_ns() + timeout;
+	while (__atomic_load_n(&smp_cpu_count, __ATOMIC_ACQUIRE) < count)
+		if (clock_monotonic_ns() > deadline)
+			return false;
+	return true;
+}
@@ -0,0 +1,372 @@
+#include <arch.h>
+#include <clock.h>
+#include <debug.h>
+#include <timer.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_LEVEL_SHIFT(l) ((l) * TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_NONE UINT64_MAX
+
+PERCPU timer_latency timer_stats = { .min = UINT64_MAX };
+PERCPU uint64_t timer_interrupt_count = 0;
+
+static PERCPU timer_base timer_cpu = { .lock = SPINLOCK_INIT("timer"),
+				       .next_event = CLOCKEVENT_OFF };
+static bool clockevent_ready = false;
+// Timers only go on CPUs whose clock event device is set up.
+static PERCPU bool timer_ready = false;
+
+static timer_base *timer_this_cpu(void)
+{
+	return this_cpu_ptr(timer_cpu);
+}
+
+void timer_init(void)
+{
+	clockevent_ready = clockevent_init();
+	this_cpu_write(timer_ready, clockevent_ready);
+	if (!clockevent_ready)
+		DEBUG_PRINTF("timer: no clock event device\n");
+}
+
+void timer_cpu_init(void)
+{
+	if (!clockevent_ready)
+		return;
+	this_cpu_write(timer_ready, clockevent_cpu_init());
+	if (!this_cpu_read(timer_ready))
+		DEBUG_PRINTF("timer: no clock event device on this CPU\n");
+}
+
+static void timer_heap_set(timer_base *base, size_t index, timer *t)
+{
+	base->heap[index] = t;
+	t->index = index;
+}
+
+static void timer_heap_up(timer_base *base, size_t index)
+{
+	timer *t = base->heap[index];
+	while (index) {
+		size_t parent = (index - 1) / 2;
+		if (base->heap[parent]->expires <= t->expires)
+			break;
+		timer_heap_set(base, index, base->heap[parent]);
+		index = parent;
+	}
+	timer_heap_set(base, index, t);
+}
+
+static void timer_heap_down(timer_base *base, size_t index)
+{
+	timer *t = base->heap[index];
+	for (;;) {
+		size_t child = index * 2 + 1;
+		if (child >= base->heap_count)
+			break;
+		if (child + 1 < base->heap_count &&
+		    base->heap[child + 1]->expires < base->heap[child]->expires)
+			child++;
+		if (t->expires <= base->heap[child]->expires)
+			break;
+		timer_heap_set(base, index, base->heap[child]);
+		index = child;
+	}
+	timer_heap_set(base, index, t);
+}
+
+static void timer_heap_remove(timer_base *base, timer *t)
+{
+	timer *last = base->heap[--base->heap_count];
+	if (last == t)
+		return;
+	timer_heap_set(base, t->index, last);
+	timer_heap_up(base, last->index);
+	timer_heap_down(base, last->index);
+}
+
+// Timers are filed on the lowest level whose slots still reach their
+// expiry, rounded up to that level's slot width so they never run early.
+// Nothing is moved between levels later on, in exchange a timeout may run
+// up to a slot width late.
+static void timer_wheel_insert(timer_base *base, timer *t)
+{
+	uint64_t tick = (t->expires >> TIMER_WHEEL_SHIFT) +
+			!!(t->expires & ((1ULL << TIMER_WHEEL_SHIFT) - 1));
+	if (tick < base->wheel_clock)
+		tick = base->wheel_clock;
+
+	size_t level = 0;
+	uint64_t index;
+	for (;; ++level) {
+		size_t shift = TIMER_LEVEL_SHIFT(level);
+		uint64_t clock = base->wheel_clock >> shift;
+		index = (tick + (1ULL << shift) - 1) >> shift;
+		if (index - clock < TIMER_WHEEL_SLOTS)
+			break;
+		// Past the last level the timer runs early and is filed again.
+		if (level == TIMER_WHEEL_LEVELS - 1) {
+			index = clock + TIMER_WHEEL_SLOTS - 1;
+			break;
+		}
+	}
+
+	size_t slot = index & TIMER_WHEEL_MASK;
+	timer **head = &base->wheel[level][slot];
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+	t->index = level * TIMER_WHEEL_SLOTS + slot;
+	base->wheel_pending[level] |= 1ULL << slot;
+	base->wheel_count++;
+}
+
+static void timer_wheel_remove(timer_base *base, timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	base->wheel_count--;
+
+	size_t level = t->index / TIMER_WHEEL_SLOTS;
+	size_t slot = t->index % TIMER_WHEEL_SLOTS;
+	if (!base->wheel[level][slot])
+		base->wheel_pending[level] &= ~(1ULL << slot);
+}
+
+// Finds the first pending slot of every level from the wheel clock on,
+// which takes one rotate and one bit scan per level.
+static uint64_t timer_wheel_next(timer_base *base)
+{
+	uint64_t next = TIMER_NONE;
+	for (size_t level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+		uint64_t pending = base->wheel_pending[level];
+		if (!pending)
+			continue;
+		size_t shift = TIMER_LEVEL_SHIFT(level);
+		uint64_t index =
+			(base->wheel_clock + (1ULL << shift) - 1) >> shift;
+		size_t start = index & TIMER_WHEEL_MASK;
+		if (start)
+			pending = pending >> start | pending << (64 - start);
+		uint64_t tick = (index + __builtin_ctzll(pending)) << shift;
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+// The wheel clock only moves when timers run, so after a long quiet spell
+// it lags behind. Nothing is due before the next pending slot, so it can
+// catch up to the present that far, which keeps new timeouts on the finest
+// level that reaches them.
+static void timer_wheel_forward(timer_base *base)
+{
+	uint64_t now = clock_monotonic_ns() >> TIMER_WHEEL_SHIFT;
+	uint64_t next = timer_wheel_next(base);
+	if (now > next)
+		now = next;
+	if (now > base->wheel_clock)
+		base->wheel_clock = now;
+}
+
+static void timer_remove(timer *t)
+{
+	if (t->coarse)
+		timer_wheel_remove(t->base, t);
+	else
+		timer_heap_remove(t->base, t);
+	t->armed = false;
+}
+
+static void timer_program(timer_base *base)
+{
+	uint64_t next = CLOCKEVENT_OFF;
+	if (base->heap_count)
+		next = base->heap[0]->expires;
+	uint64_t tick = timer_wheel_next(base);
+	if (tick != TIMER_NONE && tick << TIMER_WHEEL_SHIFT < next)
+		next = tick << TIMER_WHEEL_SHIFT;
+	if (next != base->next_event) {
+		base->next_event = next;
+		clockevent_program(next);
+	}
+}
+
+// Takes the timer off whichever CPU it was last armed on. Only that CPU's
+// clock event device can be reprogrammed, another one at worst takes an
+// interrupt for nothing. Called with interrupts off.
+static void timer_detach(timer *t)
+{
+	timer_base *base;
+	for (;;) {
+		base = __atomic_load_n(&t->base, __ATOMIC_ACQUIRE);
+		if (!base)
+			return;
+		spin_lock(&base->lock);
+		// The timer may have moved on while the lock was contended.
+		if (t->base == base)
+			break;
+		spin_unlock(&base->lock);
+	}
+	if (t->armed) {
+		timer_remove(t);
+		if (base == timer_this_cpu())
+			timer_program(base);
+	}
+	spin_unlock(&base->lock);
+}
+
+static int timer_arm(timer *t, uint64_t expires, bool coarse)
+{
+	if (!this_cpu_read(timer_ready) || !t->callback)
+		return -1;
+
+	uint64_t flags = arch_irq_save();
+	timer_detach(t);
+
+	timer_base *base = timer_this_cpu();
+	spin_lock(&base->lock);
+	if (!coarse && base->heap_count == TIMER_HEAP_SIZE) {
+		spin_unlock(&base->lock);
+		arch_irq_restore(flags);
+		return -1;
+	}
+
+	t->expires = expires;
+	__atomic_store_n(&t->base, base, __ATOMIC_RELEASE);
+	t->coarse = coarse;
+	t->armed = true;
+	if (coarse) {
+		timer_wheel_forward(base);
+		timer_wheel_insert(base, t);
+	} else {
+		base->heap[base->heap_count] = t;
+		t->index = base->heap_count++;
+		timer_heap_up(base, t->index);
+	}
+	timer_program(base);
+	spin_unlock(&base->lock);
+	arch_irq_restore(flags);
+	return 0;
+}
+
+// For deadlines that have to be met closely. Insert and cancel are
+// O(log n) in the number of such timers.
+int timer_add(timer *t, uint64_t expires)
+{
+	return timer_arm(t, expires, false);
+}
+
+// For timeouts that may run a little late. Insert and cancel are O(1)
+// however many are armed.
+int timer_add_coarse(timer *t, uint64_t expires)
+{
+	return timer_arm(t, expires, true);
+}
+
+void timer_cancel(timer *t)
+{
+	uint64_t flags = arch_irq_save();
+	timer_detach(t);
+	arch_irq_restore(flags);
+}
+
+static void timer_account(uint64_t latency)
+{
+	timer_latency *stats = this_cpu_ptr(timer_stats);
+	stats->count++;
+	stats->total += latency;
+	if (latency < stats->min)
+		stats->min = latency;
+	if (latency > stats->max)
+		stats->max = latency;
+}
+
+void timer_stats_reset(void)
+{
+	*this_cpu_ptr(timer_stats) = (timer_latency){ .min = UINT64_MAX };
+}
+
+// Callbacks run without the lock, so they can arm and cancel timers.
+static void timer_run_heap(timer_base *base)
+{
+	while (base->heap_count) {
+		uint64_t now = clock_monotonic_ns();
+		timer *t = base->heap[0];
+		if (t->expires > now)
+			break;
+		timer_heap_remove(base, t);
+		t->armed = false;
+		timer_account(now - t->expires);
+		spin_unlock(&base->lock);
+		t->callback(t);
+		spin_lock(&base->lock);
+	}
+}
+
+// The slot is taken off the wheel before its callbacks run, so they can
+// arm or cancel any timer, including the ones still waiting in the batch.
+static void timer_run_slot(timer_base *base, size_t level, size_t slot)
+{
+	timer *batch = base->wheel[level][slot];
+	if (!batch)
+		return;
+	base->wheel[level][slot] = NULL;
+	base->wheel_pending[level] &= ~(1ULL << slot);
+	batch->pprev = &batch;
+
+	while (batch) {
+		timer *t = batch;
+		*t->pprev = t->next;
+		if (t->next)
+			t->next->pprev = t->pprev;
+		base->wheel_count--;
+		if (t->expires > clock_monotonic_ns()) {
+			timer_wheel_insert(base, t);
+			continue;
+		}
+		t->armed = false;
+		spin_unlock(&base->lock);
+		t->callback(t);
+		spin_lock(&base->lock);
+	}
+}
+
+// Jumps from one pending tick to the next, so a long idle period costs no
+// more than a short one.
+static void timer_run_wheel(timer_base *base)
+{
+	uint64_t now = clock_monotonic_ns() >> TIMER_WHEEL_SHIFT;
+	for (;;) {
+		uint64_t tick = timer_wheel_next(base);
+		if (tick > now)
+			break;
+		base->wheel_clock = tick + 1;
+		for (size_t level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+			size_t shift = TIMER_LEVEL_SHIFT(level);
+			if (tick & ((1ULL << shift) - 1))
+				break;
+			timer_run_slot(base, level,
+				       (tick >> shift) & TIMER_WHEEL_MASK);
+		}
+	}
+	if (base->wheel_clock <= now)
+		base->wheel_clock = now + 1;
+}
+
+// Runs from the clock event interrupt.
+void timer_interrupt(void)
+{
+	timer_base *base = timer_this_cpu();
+	this_cpu_inc(timer_interrupt_count);
+	spin_lock(&base->lock);
+	// Whatever comes next has to be programmed, even if it is nothing.
+	base->next_event = 0;
+	timer_run_heap(base);
+	timer_run_wheel(base);
+	timer_program(base);
+	spin_unlock(&base->lock);
+}
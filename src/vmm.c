@@ -0,0 +1,484 @@
+#include <arch.h>
+#include <debug.h>
+#include <erikboot.h>
+#include <heap.h>
+#include <lock.h>
+#include <memory.h>
+#include <paging.h>
+#include <vmm.h>
+
+PERCPU uint64_t vmm_fault_count = 0;
+PERCPU uint64_t vmm_fault_cycles = 0;
+PERCPU uint64_t vmm_cow_fault_count = 0;
+PERCPU uint64_t vmm_large_fault_count = 0;
+
+static uintptr_t ioremap_next = IOREMAP_BASE;
+static spinlock ioremap_lock = SPINLOCK_INIT("ioremap");
+
+static void vmm_replace_child(address_space *space, vm_region *parent,
+			      vm_region *old, vm_region *new)
+{
+	if (!parent)
+		space->regions = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}
+
+static void vmm_rotate_left(address_space *space, vm_region *node)
+{
+	vm_region *right = node->right;
+	node->right = right->left;
+	if (right->left)
+		right->left->parent = node;
+	right->parent = node->parent;
+	vmm_replace_child(space, node->parent, node, right);
+	right->left = node;
+	node->parent = right;
+}
+
+static void vmm_rotate_right(address_space *space, vm_region *node)
+{
+	vm_region *left = node->left;
+	node->left = left->right;
+	if (left->right)
+		left->right->parent = node;
+	left->parent = node->parent;
+	vmm_replace_child(space, node->parent, node, left);
+	left->right = node;
+	node->parent = left;
+}
+
+static bool vmm_is_red(vm_region *node)
+{
+	return node && node->red;
+}
+
+static void vmm_insert_fixup(address_space *space, vm_region *node)
+{
+	while (vmm_is_red(node->parent)) {
+		vm_region *parent = node->parent;
+		vm_region *grandparent = parent->parent;
+		if (parent == grandparent->left) {
+			vm_region *uncle = grandparent->right;
+			if (vmm_is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+			if (node == parent->right) {
+				vmm_rotate_left(space, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			grandparent->red = true;
+			vmm_rotate_right(space, grandparent);
+		} else {
+			vm_region *uncle = grandparent->left;
+			if (vmm_is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+			if (node == parent->left) {
+				vmm_rotate_right(space, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			grandparent->red = true;
+			vmm_rotate_left(space, grandparent);
+		}
+	}
+	space->regions->red = false;
+}
+
+int vmm_add_region(address_space *space, vm_region *region)
+{
+	write_lock(&space->regions_lock);
+	vm_region *parent = NULL;
+	vm_region **link = &space->regions;
+	while (*link) {
+		parent = *link;
+		if (region->end <= parent->start)
+			link = &parent->left;
+		else if (region->start >= parent->end)
+			link = &parent->right;
+		else {
+			write_unlock(&space->regions_lock);
+			return -1;
+		}
+	}
+
+	region->left = NULL;
+	region->right = NULL;
+	region->parent = parent;
+	region->red = true;
+	*link = region;
+	vmm_insert_fixup(space, region);
+	write_unlock(&space->regions_lock);
+	return 0;
+}
+
+// Maps physical memory into a space page by page as it is touched. The
+// memory stays owned by whoever handed it out, so copy-on-write mappings
+// take a reference on each page to keep it from being written in place.
+int vmm_map_physical(address_space *space, uintptr_t vaddr, uintptr_t paddr,
+		     size_t size, uint64_t flags)
+{
+	vm_region *region = malloc(sizeof(vm_region));
+	if (!region)
+		return -1;
+	region->start = vaddr;
+	region->end = vaddr + size;
+	region->flags = flags;
+	region->backing = paddr;
+	region->large = false;
+	if (vmm_add_region(space, region) < 0) {
+		free(region);
+		return -1;
+	}
+	return 0;
+}
+
+// Node took the place of a black node and is short one black node on its
+// path, which has to be made up for. Node may be NULL, so its parent is
+// passed along.
+static void vmm_remove_fixup(address_space *space, vm_region *node,
+			     vm_region *parent)
+{
+	while (node != space->regions && !vmm_is_red(node)) {
+		if (node == parent->left) {
+			vm_region *sibling = parent->right;
+			if (sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				vmm_rotate_left(space, parent);
+				sibling = parent->right;
+			}
+			if (!vmm_is_red(sibling->left) &&
+			    !vmm_is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (!vmm_is_red(sibling->right)) {
+				sibling->left->red = false;
+				sibling->red = true;
+				vmm_rotate_right(space, sibling);
+				sibling = parent->right;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->right->red = false;
+			vmm_rotate_left(space, parent);
+		} else {
+			vm_region *sibling = parent->left;
+			if (sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				vmm_rotate_right(space, parent);
+				sibling = parent->left;
+			}
+			if (!vmm_is_red(sibling->left) &&
+			    !vmm_is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (!vmm_is_red(sibling->left)) {
+				sibling->right->red = false;
+				sibling->red = true;
+				vmm_rotate_left(space, sibling);
+				sibling = parent->left;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->left->red = false;
+			vmm_rotate_right(space, parent);
+		}
+		node = space->regions;
+	}
+	if (node)
+		node->red = false;
+}
+
+void vmm_remove_region(address_space *space, vm_region *region)
+{
+	vm_region *child, *parent;
+	bool red;
+	write_lock(&space->regions_lock);
+	if (region->left && region->right) {
+		// The region's successor takes its place in the tree.
+		vm_region *next = region->right;
+		while (next->left)
+			next = next->left;
+
+		child = next->right;
+		parent = next->parent;
+		red = next->red;
+		if (parent == region) {
+			parent = next;
+		} else {
+			if (child)
+				child->parent = parent;
+			parent->left = child;
+			next->right = region->right;
+			region->right->parent = next;
+		}
+		next->left = region->left;
+		region->left->parent = next;
+		next->parent = region->parent;
+		next->red = region->red;
+		vmm_replace_child(space, region->parent, region, next);
+	} else {
+		child = region->left ? region->left : region->right;
+		parent = region->parent;
+		red = region->red;
+		if (child)
+			child->parent = parent;
+		vmm_replace_child(space, parent, region, child);
+	}
+
+	if (!red)
+		vmm_remove_fixup(space, child, parent);
+	write_unlock(&space->regions_lock);
+}
+
+// Called with the regions lock held.
+static vm_region *vmm_search(address_space *space, uintptr_t vaddr)
+{
+	vm_region *node = space->regions;
+	while (node) {
+		if (vaddr < node->start)
+			node = node->left;
+		else if (vaddr >= node->end)
+			node = node->right;
+		else
+			return node;
+	}
+	return NULL;
+}
+
+vm_region *vmm_find_region(address_space *space, uintptr_t vaddr)
+{
+	read_lock(&space->regions_lock);
+	vm_region *region = vmm_search(space, vaddr);
+	read_unlock(&space->regions_lock);
+	return region;
+}
+
+vm_region *vmm_first_region(address_space *space)
+{
+	vm_region *node = space->regions;
+	while (node && node->left)
+		node = node->left;
+	return node;
+}
+
+vm_region *vmm_next_region(vm_region *region)
+{
+	if (region->right) {
+		region = region->right;
+		while (region->left)
+			region = region->left;
+		return region;
+	}
+	while (region->parent && region == region->parent->right)
+		region = region->parent;
+	return region->parent;
+}
+
+// Maps device memory or a framebuffer into the kernel half with the memory
+// type given in flags. Windows of 2 MiB or more share their offset into a
+// large page with the physical address, so large pages cover what they
+// can.
+void *ioremap(uintptr_t paddr, size_t size, uint64_t flags)
+{
+	uintptr_t offset = paddr & (PAGE_SIZE - 1);
+	paddr -= offset;
+	size = (size + offset + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	spin_lock(&ioremap_lock);
+	uintptr_t vaddr = ioremap_next;
+	if (size >= LARGE_PAGE_SIZE)
+		vaddr = ((vaddr + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1)) +
+			(paddr & (LARGE_PAGE_SIZE - 1));
+	if (vaddr + size > IOREMAP_BASE + IOREMAP_SIZE) {
+		spin_unlock(&ioremap_lock);
+		return NULL;
+	}
+
+	if (paging_map_range(&kernel_space, vaddr, paddr, size, flags) < 0) {
+		paging_unmap_range(&kernel_space, vaddr, size);
+		spin_unlock(&ioremap_lock);
+		return NULL;
+	}
+
+	ioremap_next = vaddr + size;
+	spin_unlock(&ioremap_lock);
+	return (void *)(vaddr + offset);
+}
+
+void iounmap(void *vaddr, size_t size)
+{
+	uintptr_t offset = (uintptr_t)vaddr & (PAGE_SIZE - 1);
+	paging_unmap_range(&kernel_space, (uintptr_t)vaddr - offset,
+			   (size + offset + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
+address_space *vmm_clone_space(address_space *parent)
+{
+	address_space *child = paging_clone_space(parent);
+	if (!child)
+		return NULL;
+
+	read_lock(&parent->regions_lock);
+	for (vm_region *r = vmm_first_region(parent); r;
+	     r = vmm_next_region(r)) {
+		vm_region *region = malloc(sizeof(vm_region));
+		if (region) {
+			*region = *r;
+			if (vmm_add_region(child, region) == 0)
+				continue;
+			free(region);
+		}
+		read_unlock(&parent->regions_lock);
+		vmm_destroy_space(child);
+		return NULL;
+	}
+	read_unlock(&parent->regions_lock);
+	return child;
+}
+
+static void vmm_free_regions(vm_region *region)
+{
+	if (!region)
+		return;
+	vmm_free_regions(region->left);
+	vmm_free_regions(region->right);
+	free(region);
+}
+
+// Frees the regions and page tables of a space no CPU has loaded.
+void vmm_destroy_space(address_space *space)
+{
+	write_lock(&space->regions_lock);
+	vm_region *regions = space->regions;
+	space->regions = NULL;
+	write_unlock(&space->regions_lock);
+	vmm_free_regions(regions);
+	paging_destroy_space(space);
+}
+
+// Backs the whole large page around vaddr with one physically contiguous
+// block. Once part of it is mapped with small pages, or no aligned block is
+// free, the rest of it is filled page by page.
+static bool vmm_fault_large(address_space *space, vm_region *region,
+			    uintptr_t vaddr)
+{
+	uintptr_t page = vaddr & ~(LARGE_PAGE_SIZE - 1);
+	if (page < region->start || page + LARGE_PAGE_SIZE > region->end ||
+	    !paging_large_page_unmapped(space, page))
+		return false;
+
+	const size_t frames = LARGE_PAGE_SIZE / PAGE_SIZE;
+	intptr_t frame = find_free_frames_aligned(frames, LARGE_PAGE_SIZE);
+	if (frame < 0)
+		return false;
+	memset(phys_to_virt(frame), 0, LARGE_PAGE_SIZE);
+
+	// The mapping takes its own reference, so the block is freed here if
+	// it was not mapped. Another CPU may have filled any of it in
+	// meanwhile, the caller then goes on page by page.
+	int error = paging_map_large_page(space, page, frame,
+					  region->flags | P_FILL | P_OWNED);
+	paging_put_frames(frame, LARGE_PAGE_SIZE);
+	if (error)
+		return false;
+	this_cpu_inc(vmm_large_fault_count);
+	return true;
+}
+
+static bool vmm_fault_region(address_space *space, vm_region *region,
+			     uintptr_t vaddr, uint64_t fault)
+{
+	if (!region || (fault & VM_FAULT_PROTECTION))
+		return false;
+	if ((fault & VM_FAULT_WRITE) && !(region->flags & P_WRITE))
+		return false;
+	if ((fault & VM_FAULT_USER) && !(region->flags & P_USER))
+		return false;
+
+	uintptr_t page = vaddr & ~(PAGE_SIZE - 1);
+	int error = 0;
+	if (region->backing) {
+		// Copy-on-write pages hold on to the frame, so the first write
+		// copies it instead of taking the backing over.
+		uintptr_t paddr = region->backing + page - region->start;
+		uint64_t flags = region->flags | P_FILL;
+		if (flags & P_COW)
+			flags |= P_OWNED;
+		error = paging_map_page(space, page, paddr, flags);
+	} else if (!region->large || !vmm_fault_large(space, region, vaddr)) {
+		intptr_t frame = find_free_frames(1);
+		if (frame < 0)
+			return false;
+		memset(phys_to_virt(frame), 0, PAGE_SIZE);
+
+		// A fault on another CPU may have won the race for the page,
+		// the frame is then freed along with the reference.
+		error = paging_map_page(space, page, frame,
+					region->flags | P_FILL | P_OWNED);
+		paging_put_frames(frame, PAGE_SIZE);
+	}
+	if (error < 0)
+		return false;
+
+	// Someone else mapped the page first. The fault came from whatever
+	// this CPU still had cached from before.
+	if (error)
+		paging_invalidate(space, page);
+	return true;
+}
+
+bool vmm_handle_fault(uintptr_t vaddr, uint64_t fault)
+{
+	uint64_t start = arch_cycles();
+
+	// The kernel half is shared, so its regions live in the kernel space
+	// no matter which space took the fault.
+	address_space *space =
+		vaddr >= KERNEL_HALF_BASE ? &kernel_space :
+					    this_cpu_read(current_space);
+
+	// A write to a present page may hit one shared by a clone.
+	if ((fault & VM_FAULT_PROTECTION) && (fault & VM_FAULT_WRITE) &&
+	    space == this_cpu_read(current_space)) {
+		if (!paging_resolve_cow(space, vaddr, fault & VM_FAULT_USER))
+			return false;
+		this_cpu_inc(vmm_cow_fault_count);
+		this_cpu_add(vmm_fault_cycles, arch_cycles() - start);
+		return true;
+	}
+
+	// The region cannot go away while its pages are filled in.
+	read_lock(&space->regions_lock);
+	bool handled = vmm_fault_region(space, vmm_search(space, vaddr), vaddr,
+					fault);
+	read_unlock(&space->regions_lock);
+	if (!handled)
+		return false;
+
+	this_cpu_inc(vmm_fault_count);
+	this_cpu_add(vmm_fault_cycles, arch_cycles() - start);
+	return true;
+}
@@ -11,12 +11,20 @@ set(CMAKE_C_COMPILER_TARGET x86_64-none-elf)
 set(CMAKE_CXX_COMPILER_TARGET x86_64-none-elf)
 add_compile_options(-target ${CMAKE_C_COMPILER_TARGET})
 add_link_options(-target ${CMAKE_C_COMPILER_TARGET})
+# Interrupt and exception entry only saves the general purpose registers.
+add_compile_options(-mno-sse -mno-sse2 -mno-mmx -mno-avx)
 
 set(ARCH_SOURCES
+    src/arch/x86_64/acpi.c
+    src/arch/x86_64/apic.c
     src/arch/x86_64/arch.c
     src/arch/x86_64/gdt.c
     src/arch/x86_64/idt.c
     src/arch/x86_64/isrs.S
-    src/arch/x86_64/paging.c)
+    src/arch/x86_64/paging.c
+    src/arch/x86_64/smp.c
+    src/arch/x86_64/timer.c
+    src/arch/x86_64/trampoline.S
+    src/arch/x86_64/tsc.c)
 
 option(X64_UART "Support for UART on x86_64" CACHE)